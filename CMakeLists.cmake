@@ -114,8 +114,31 @@ add_custom_command(TARGET "mdet${TARGET_MODIFIER}" POST_BUILD
    COMMAND ${CMAKE_COMMAND} -E copy
        "${OpenCV_CONFIG_PATH}/../bin/opencv_imgproc${OpenCV_VERSION_SUFFIX}.dll"
        "$<TARGET_FILE_DIR:mdet${TARGET_MODIFIER}>"
+   COMMAND ${CMAKE_COMMAND} -E copy
+       "${OpenCV_CONFIG_PATH}/../bin/opencv_video${OpenCV_VERSION_SUFFIX}d.dll"
+       "$<TARGET_FILE_DIR:mdet${TARGET_MODIFIER}>"
+   COMMAND ${CMAKE_COMMAND} -E copy
+       "${OpenCV_CONFIG_PATH}/../bin/opencv_video${OpenCV_VERSION_SUFFIX}.dll"
+       "$<TARGET_FILE_DIR:mdet${TARGET_MODIFIER}>"
    COMMAND ${CMAKE_COMMAND} -E copy
        "${OpenCV_CONFIG_PATH}/../bin/opencv_ffmpeg${OpenCV_VERSION_SUFFIX}_64.dll"
        "$<TARGET_FILE_DIR:mdet${TARGET_MODIFIER}>"
    COMMENT "Copying OpenCV DLLs to build directory"
-       )
\ No newline at end of file
+       )
+
+if(UNIX AND NOT APPLE)
+  # shm_open (frame bus) lives in librt on older glibc
+  target_link_libraries("mdet${TARGET_MODIFIER}" rt)
+endif()
+
+###############################################################################
+# mdet-framebus-reader (an example frame bus consumer; no OpenCV needed)
+###############################################################################
+add_executable(mdet-framebus-reader
+  examples/framebus_reader.cpp
+  src/framebus.cpp
+  src/framebus.hpp
+  )
+if(UNIX AND NOT APPLE)
+  target_link_libraries(mdet-framebus-reader rt)
+endif()
@@ -0,0 +1,76 @@
+// An example frame bus consumer: follows mdet's --frame-bus and prints each
+// frame's metadata with its mean brightness (a stand-in for real analysis
+// on the pixels, which are used in place).
+//
+//   mdet64 --frame-bus=mdet-frames
+//   mdet-framebus-reader mdet-frames
+#include "../src/framebus.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+// the producer stamps every frame; this long without one means it went away
+static const int64_t STALE_US = 5*1000*1000;
+
+static int64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, const char **argv)
+{
+  if (argc != 2) {
+    std::cerr << "usage: " << argv[0] << " NAME\n";
+    return EXIT_FAILURE;
+  }
+  frame_bus_reader fbr;
+  int64_t last_frame_us = now_us();
+  while (true) {
+    if (!fbr.is_open()) {
+      std::string error;
+      if (!fbr.open(argv[1], error)) {
+        std::cerr << argv[1] << ": " << error << "; retrying\n";
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        continue;
+      }
+      std::cout << argv[1] << ": " << fbr.header->width << "x" <<
+        fbr.header->height << ", " << fbr.header->slots << " slots\n";
+      last_frame_us = now_us();
+    }
+
+    frame_bus_frame f;
+    if (!fbr.next(f)) {
+      if (now_us() - last_frame_us > STALE_US) {
+        // mdet restarted (a new bus) or exited
+        std::cerr << argv[1] << ": no frames; reopening\n";
+        fbr.close();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      continue;
+    }
+    last_frame_us = now_us();
+
+    uint64_t sum = 0;
+    for (int y = 0; y < f.height; y++) {
+      const uint8_t *row = f.pixels + y*f.stride;
+      for (int x = 0; x < 3*f.width; x++)
+        sum += row[x];
+    }
+    // the producer may have lapped us while we were reading
+    if (!fbr.still_valid(f))
+      continue;
+
+    std::cout << "frame " << f.seq <<
+      " t=" << f.metadata.time_us <<
+      " score=" << f.metadata.motion_score <<
+      " threshold=" << f.metadata.threshold <<
+      ((f.metadata.flags & FRAME_BUS_TRIGGERED) ? " triggered" : "") <<
+      ((f.metadata.flags & FRAME_BUS_RECORDING) ? " recording" : "") <<
+      ((f.metadata.flags & FRAME_BUS_UNSCORED) ? " unscored" : "") <<
+      ((f.metadata.flags & FRAME_BUS_BOUNDED) ? " bounded" : "") <<
+      " mean=" << (double)sum/(3.0*f.width*f.height) <<
+      " (dropped " << fbr.dropped << ")\n";
+  }
+}
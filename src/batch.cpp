@@ -0,0 +1,318 @@
+#include "batch.hpp"
+#include "calibrator.hpp"
+#include "fs.hpp"
+#include "mdet.hpp"
+
+#include <atomic>
+
+static const char *const VIDEO_EXTENSIONS[] {
+  ".mp4", ".avi", ".mkv", ".mov", ".m4v", ".wmv",
+};
+
+// a CSV field, quoted (embedded quotes are doubled)
+static std::string csv_quote(const std::string &s) {
+  std::string quoted = "\"";
+  for (char c : s) {
+    if (c == '"')
+      quoted += '"';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+static bool is_video_file(const std::string &path) {
+  auto dot = path.rfind('.');
+  if (dot == std::string::npos)
+    return false;
+  std::string ext = path.substr(dot);
+  for (char &c : ext)
+    c = (char)std::tolower((unsigned char)c);
+  for (const char *ve : VIDEO_EXTENSIONS)
+    if (ext == ve)
+      return true;
+  return false;
+}
+
+// * and ? wildcards
+static bool wildcard_match(const char *pattern, const char *str) {
+  if (*pattern == 0)
+    return *str == 0;
+  if (*pattern == '*') {
+    for (const char *s = str; ; s++) {
+      if (wildcard_match(pattern + 1, s))
+        return true;
+      if (*s == 0)
+        return false;
+    }
+  }
+  if (*str == 0)
+    return false;
+  return (*pattern == '?' || *pattern == *str) &&
+    wildcard_match(pattern + 1, str + 1);
+}
+
+static bool expand_input(
+  const std::string &input, std::vector<std::string> &files)
+{
+  if (fs::file_exists(input)) {
+    files.push_back(input);
+    return true;
+  } else if (fs::directory_exists(input)) {
+    for (const auto &f : fs::list_directory(input))
+      if (is_video_file(f))
+        files.push_back(f);
+    return true;
+  }
+  auto slash = input.find_last_of("/\\");
+  std::string dir = slash == std::string::npos ? "." : input.substr(0, slash);
+  std::string pattern =
+    slash == std::string::npos ? input : input.substr(slash + 1);
+  if (pattern.find_first_of("*?") == std::string::npos ||
+    !fs::directory_exists(dir))
+  {
+    return false;
+  }
+  for (const auto &f : fs::list_directory(dir)) {
+    auto fslash = f.find_last_of("/\\");
+    std::string name = fslash == std::string::npos ? f : f.substr(fslash + 1);
+    if (wildcard_match(pattern.c_str(), name.c_str()))
+      files.push_back(f);
+  }
+  return true;
+}
+
+struct batch_event {
+  int64_t frame;
+  double  score, threshold;
+};
+
+struct batch_file {
+  std::string path;
+  double      fps = 0.0;
+  int64_t     frame_count = 0;
+  // from all its chunks
+  int64_t     frames_read = 0, frames_scored = 0;
+  double      busy_s = 0.0;
+  std::vector<batch_event> events;
+  std::string error;
+};
+
+struct batch_chunk {
+  size_t   file;
+  int64_t  start_frame, end_frame; // end_frame -1 means to the end
+  int64_t  frames_read = 0, frames_scored = 0;
+  double   busy_s = 0.0;
+  std::vector<batch_event> events;
+  std::string error;
+
+  void run(const batch_options &bo, const batch_file &bf);
+};
+
+void batch_chunk::run(const batch_options &bo, const batch_file &bf)
+{
+  auto started = now();
+  cv::VideoCapture vc(bf.path);
+  if (!vc.isOpened()) {
+    error = "failed to open video";
+    return;
+  }
+  // the seek may land on a keyframe before start_frame (or past it)
+  int64_t first_frame = 0;
+  if (start_frame > 0) {
+    vc.set(cv::CAP_PROP_POS_FRAMES, (double)start_frame);
+    first_frame = (int64_t)vc.get(cv::CAP_PROP_POS_FRAMES);
+    if (first_frame < 0)
+      first_frame = start_frame; // (the backend can't tell)
+    if (first_frame > start_frame) {
+      // nobody would score the frames it jumped over; so read up to
+      // start_frame from the beginning instead
+      vc.open(bf.path);
+      if (!vc.isOpened()) {
+        error = "failed to reopen video";
+        return;
+      }
+      first_frame = 0;
+    }
+    // the previous chunk reads and scores these
+    for (; first_frame < start_frame; first_frame++)
+      if (!vc.grab())
+        return;
+  }
+
+  std::unique_ptr<detector> det = create_detector(bo.detector, error);
+  if (!det)
+    return;
+  online_calibrator calibrator;
+  calibrator.mad_units = bo.calibration_mad_units;
+  const bool calibrate = bo.threshold <= 0.0;
+  double threshold = bo.threshold;
+  const int64_t holdoff_frames = (int64_t)(bo.holdoff_s*bf.fps);
+
+  image frame;
+  bool has_background = false;
+  int64_t holdoff_until = -1;
+  for (int64_t f = first_frame; end_frame < 0 || f < end_frame; f++) {
+    const bool scored = (f - start_frame) % bo.step == 0 &&
+      f >= holdoff_until;
+    // grab() alone skips the conversion to BGR
+    if (scored ? !vc.read(frame) || frame.empty() : !vc.grab())
+      break;
+    frames_read++;
+    if (!scored)
+      continue;
+    if (!has_background) {
+      det->reset(frame);
+      has_background = true;
+      continue;
+    }
+    frames_scored++;
+    double score = det->score(frame,
+      calibrate && !calibrator.calibrated() ? 0.0 : threshold);
+    bool triggered = threshold > 0.0 && score > threshold;
+    det->learn(triggered);
+    if (triggered) {
+      events.push_back(batch_event{f, score, threshold});
+      holdoff_until = f + 1 + holdoff_frames;
+      has_background = false;
+    } else if (calibrate && calibrator.add(score)) {
+      threshold = calibrator.threshold;
+    }
+  }
+  busy_s = std::chrono::duration_cast<std::chrono::microseconds>(
+    now() - started).count()/1000.0/1000.0;
+}
+
+int run_batch(const batch_options &bo)
+{
+  auto batch_started = now();
+  if (bo.step <= 0) {
+    std::cerr << "the batch step must be positive\n";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<batch_file> files;
+  for (const std::string &input : bo.inputs) {
+    std::vector<std::string> paths;
+    if (!expand_input(input, paths)) {
+      std::cerr << input << ": no such file, directory or pattern\n";
+      return EXIT_FAILURE;
+    }
+    for (const auto &p : paths) {
+      files.emplace_back();
+      files.back().path = p;
+    }
+  }
+  if (files.empty()) {
+    std::cerr << "no videos to analyze\n";
+    return EXIT_FAILURE;
+  }
+
+  // split into chunks (opening each file once for its length)
+  std::vector<batch_chunk> chunks;
+  for (size_t i = 0; i < files.size(); i++) {
+    batch_file &bf = files[i];
+    cv::VideoCapture vc(bf.path);
+    if (!vc.isOpened()) {
+      bf.error = "failed to open video";
+      continue;
+    }
+    bf.fps = vc.get(cv::CAP_PROP_FPS);
+    if (bf.fps <= 0.0)
+      bf.fps = TARGET_FPS;
+    bf.frame_count = (int64_t)vc.get(cv::CAP_PROP_FRAME_COUNT);
+    const int64_t chunk_frames = (int64_t)(bo.chunk_s*bf.fps);
+    if (bo.chunk_s <= 0 || bf.frame_count <= 0 ||
+      bf.frame_count <= chunk_frames)
+    {
+      chunks.push_back(batch_chunk{i, 0, -1});
+      continue;
+    }
+    for (int64_t s = 0; s < bf.frame_count; s += chunk_frames) {
+      // the last chunk runs to the end in case the count was an estimate
+      int64_t e = s + chunk_frames >= bf.frame_count ? -1 : s + chunk_frames;
+      chunks.push_back(batch_chunk{i, s, e});
+    }
+  }
+
+  int jobs = bo.jobs > 0 ? bo.jobs : (int)std::thread::hardware_concurrency();
+  jobs = std::max(1, std::min(jobs, (int)chunks.size()));
+  std::cout << files.size() << " files in " << chunks.size() <<
+    " chunks on " << jobs << " threads (detector " << bo.detector;
+  if (bo.step > 1)
+    std::cout << ", scoring every " << bo.step << " frames";
+  std::cout << ")\n";
+
+  std::mutex progress_mutex;
+  size_t chunks_done = 0;
+  std::atomic<size_t> next_chunk(0);
+  auto worker = [&] () {
+    size_t ci;
+    while ((ci = next_chunk++) < chunks.size()) {
+      chunks[ci].run(bo, files[chunks[ci].file]);
+      std::lock_guard<std::mutex> lk(progress_mutex);
+      chunks_done++;
+      std::cerr << "\r" << chunks_done << "/" << chunks.size() << " chunks";
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < jobs; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads)
+    t.join();
+  std::cerr << "\n";
+
+  // chunks are in file and frame order
+  for (batch_chunk &bc : chunks) {
+    batch_file &bf = files[bc.file];
+    bf.frames_read += bc.frames_read;
+    bf.frames_scored += bc.frames_scored;
+    bf.busy_s += bc.busy_s;
+    bf.events.insert(bf.events.end(), bc.events.begin(), bc.events.end());
+    if (!bc.error.empty() && bf.error.empty())
+      bf.error = bc.error;
+  }
+
+  if (!bo.csv_path.empty()) {
+    std::ofstream csv(bo.csv_path);
+    if (!csv) {
+      std::cerr << bo.csv_path << ": failed to open\n";
+      return EXIT_FAILURE;
+    }
+    csv << "file,frame,offset_s,score,threshold\n";
+    for (const batch_file &bf : files)
+      for (const batch_event &be : bf.events)
+        csv << csv_quote(bf.path) << "," << be.frame << "," <<
+          format(be.frame/bf.fps,0,3) << "," <<
+          format(be.score,0,3) << "," << format(be.threshold,0,3) << "\n";
+  }
+
+  std::stringstream ss;
+  ss << "  events    frames   video s   busy s  x real time  file\n";
+  double total_video_s = 0.0;
+  int failures = 0;
+  for (const batch_file &bf : files) {
+    const double video_s = bf.fps > 0.0 ? bf.frames_read/bf.fps : 0.0;
+    total_video_s += video_s;
+    ss << std::setw(8) << bf.events.size() <<
+      std::setw(10) << bf.frames_read <<
+      std::setw(10) << format(video_s,0,1) <<
+      std::setw(9) << format(bf.busy_s,0,1) <<
+      std::setw(13) << format(bf.busy_s > 0.0 ? video_s/bf.busy_s : 0.0,0,1) <<
+      "  " << bf.path;
+    if (!bf.error.empty()) {
+      ss << " (ERROR: " << bf.error << ")";
+      failures++;
+    }
+    ss << "\n";
+  }
+  auto elapsed_s =
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      now() - batch_started).count()/1000.0/1000.0;
+  ss << format(total_video_s/3600.0,0,2) << " h of video in " <<
+    format(elapsed_s,0,1) << " s (" <<
+    format(elapsed_s > 0.0 ? total_video_s/elapsed_s : 0.0,0,1) <<
+    "x real time)\n";
+  std::cout << ss.str();
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
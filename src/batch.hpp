@@ -0,0 +1,37 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <string>
+#include <vector>
+
+// Batch mode runs a detector over archived videos (ones mdet didn't
+// record) and reports where the motion is.
+//
+// Inputs are files, directories (every video in them) or wildcard patterns
+// on the file name (e.g. archive/cam2-*.mp4).  Long files are split into
+// chunks of chunk_s seconds; files and chunks are handed to a pool of
+// workers, each decoding and scoring its own.  Every chunk starts with a
+// fresh background and calibration, like the live detector after a
+// restart.
+//
+// OpenCV can't decode keyframes only, so the coarse pass (step > 1) grabs
+// (demuxes and decodes) every frame but converts and scores only every
+// step'th one; that skips the color conversion and detection, which are
+// most of the per-frame cost after decoding.  An event's frame is then only
+// good to within step frames.
+struct batch_options {
+  std::vector<std::string> inputs;
+  std::string              detector;
+  double                   threshold = 0.0; // <= 0.0 means calibrate online
+  double                   calibration_mad_units = 6.0;
+  double                   holdoff_s = 30.0; // ignored after an event
+  int                      step = 1;         // score every step'th frame
+  int                      chunk_s = 30*60;  // 0 means whole files
+  int                      jobs = 0;         // 0 means one per hardware thread
+  std::string              csv_path;         // events (one line each)
+};
+
+// runs a batch; returns the process exit code
+int run_batch(const batch_options &bo);
+
+#endif
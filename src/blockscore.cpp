@@ -0,0 +1,351 @@
+#include "blockscore.hpp"
+#include "fs.hpp"
+
+#include <opencv2/core/hal/intrin.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+struct activity_map_header {
+  char     magic[8];
+  uint32_t version;
+  uint16_t cols, rows;
+  uint16_t block_size;
+  uint16_t camera; // opts::camera (a map is only good for its own view)
+};
+static_assert(sizeof(activity_map_header) == 20, "unexpected header size");
+struct activity_map_entry {
+  uint32_t observed;
+  float    noise, level;
+  uint8_t  masked, sparse;
+  uint8_t  reserved[2];
+};
+static const char ACTIVITY_MAP_MAGIC[8] = {'M','D','A','C','T','M','A','P'};
+static const uint32_t ACTIVITY_MAP_VERSION = 2; // 2 added the camera
+
+void block_scorer::reset(cv::Size sz)
+{
+  frame_size = sz;
+  cols = (sz.width + SCORE_BLOCK_SIZE - 1)/SCORE_BLOCK_SIZE;
+  rows = (sz.height + SCORE_BLOCK_SIZE - 1)/SCORE_BLOCK_SIZE;
+
+  // pass oy sweeps the block rows oy + k*STRIDE
+  row_order.clear();
+  for (int oy = 0; oy < SCORE_BLOCK_STRIDE; oy++)
+    for (int by = oy; by < rows; by += SCORE_BLOCK_STRIDE)
+      row_order.push_back(by);
+  row_sums.assign(cols, 0);
+
+  blocks.assign(cols*rows, block());
+  active.clear();
+  read.clear();
+  generation = 0;
+  frames = 0;
+  classify();
+}
+
+cv::Rect block_scorer::block_rect(int b) const
+{
+  int x = (b % cols)*SCORE_BLOCK_SIZE, y = (b / cols)*SCORE_BLOCK_SIZE;
+  return cv::Rect(x, y,
+    std::min(SCORE_BLOCK_SIZE, frame_size.width - x),
+    std::min(SCORE_BLOCK_SIZE, frame_size.height - y));
+}
+
+// the sum of absolute differences of n pixels
+static uint32_t sad(const uint8_t *p, const uint8_t *q, int n)
+{
+#if CV_SIMD128
+  // a whole block's row is one register (psadbw on x86)
+  if (n == SCORE_BLOCK_SIZE)
+    return cv::v_reduce_sad(cv::v_load(p), cv::v_load(q));
+#endif
+  uint32_t sum = 0;
+  for (int x = 0; x < n; x++)
+    sum += p[x] > q[x] ? p[x] - q[x] : q[x] - p[x];
+  return sum;
+}
+
+uint32_t block_scorer::block_sum(
+  const cv::Mat &gray, const cv::Mat &background, int b) const
+{
+  const cv::Rect r = block_rect(b);
+  uint32_t sum = 0;
+  for (int y = r.y; y < r.y + r.height; y++) {
+    sum += sad(gray.ptr<uint8_t>(y) + r.x, background.ptr<uint8_t>(y) + r.x,
+      r.width);
+  }
+  return sum;
+}
+
+void block_scorer::sum_block_row(
+  const cv::Mat &gray, const cv::Mat &background, int by)
+{
+  // one sweep down the row's pixel rows reads each cache line once
+  const int y0 = by*SCORE_BLOCK_SIZE;
+  const int y1 = std::min(y0 + SCORE_BLOCK_SIZE, frame_size.height);
+  const block *row = &blocks[by*cols];
+  std::fill(row_sums.begin(), row_sums.end(), 0);
+  for (int y = y0; y < y1; y++) {
+    const uint8_t *p = gray.ptr<uint8_t>(y);
+    const uint8_t *q = background.ptr<uint8_t>(y);
+    for (int bx = 0; bx < cols; bx++) {
+      if (row[bx].visited == generation)
+        continue;
+      const int x = bx*SCORE_BLOCK_SIZE;
+      row_sums[bx] += sad(p + x, q + x,
+        std::min(SCORE_BLOCK_SIZE, frame_size.width - x));
+    }
+  }
+}
+
+double block_scorer::score(
+  const cv::Mat &gray, const cv::Mat &background, double threshold)
+{
+  CV_Assert(gray.type() == CV_8UC1 && background.type() == CV_8UC1 &&
+    gray.size() == background.size());
+  if (gray.size() != frame_size)
+    reset(gray.size());
+  if (++generation == 0) { // wrapped; forget when blocks were read
+    for (block &b : blocks)
+      b.visited = 0;
+    generation = 1;
+  }
+  frames++;
+
+  const uint64_t area = unmasked_area;
+  const bool can_exit = threshold > 0.0;
+  const double threshold_sum = threshold*area;
+
+  std::vector<int> was_active;
+  was_active.swap(active);
+  read.clear();
+  uint64_t sum = 0, scanned_area = 0;
+  int min_bx = cols, min_by = rows, max_bx = -1, max_by = -1;
+  blocks_scored = 0;
+  early_exit = false;
+
+  auto is_due = [&] (int b) {
+    return (frames + (uint64_t)b) % ACTIVITY_SPARSE_PERIOD == 0;
+  };
+  // masked blocks never count; a few are read each frame to keep learning
+  for (int b : masked) {
+    if (is_due(b)) {
+      blocks[b].last_sum = block_sum(gray, background, b);
+      read.push_back(b);
+    }
+    blocks[b].visited = generation;
+  }
+  // static blocks between reads count as their last sum
+  for (int b : sparse) {
+    if (!is_due(b)) {
+      blocks[b].visited = generation;
+      sum += blocks[b].last_sum;
+      scanned_area += (uint64_t)block_rect(b).area();
+    }
+  }
+
+  auto add_block = [&] (int b, uint32_t bs) {
+    const cv::Rect r = block_rect(b);
+    blocks[b].visited = generation;
+    blocks[b].last_sum = bs;
+    read.push_back(b);
+    blocks_scored++;
+    sum += bs;
+    scanned_area += (uint64_t)r.area();
+    if (bs > (uint32_t)(SCORE_BLOCK_ACTIVE_DIFF*r.area())) {
+      active.push_back(b);
+      min_bx = std::min(min_bx, b % cols);
+      max_bx = std::max(max_bx, b % cols);
+      min_by = std::min(min_by, b / cols);
+      max_by = std::max(max_by, b / cols);
+    }
+    if (!can_exit)
+      return false;
+    return sum > threshold_sum || // exceeded
+      sum + 255.0*(area - scanned_area) < threshold_sum; // can't reach
+  };
+
+  bool decided = false;
+  // (an exact score reads everything; the order doesn't matter)
+  for (size_t i = 0; can_exit && i < was_active.size(); i++) {
+    const int b = was_active[i];
+    if (blocks[b].visited != generation &&
+      (decided = add_block(b, block_sum(gray, background, b))))
+    {
+      break;
+    }
+  }
+  for (size_t i = 0; !decided && i < row_order.size(); i++) {
+    const int by = row_order[i];
+    sum_block_row(gray, background, by);
+    for (int bx = 0; bx < cols && !decided; bx++) {
+      if (blocks[by*cols + bx].visited != generation)
+        decided = add_block(by*cols + bx, row_sums[bx]);
+    }
+  }
+  early_exit = decided && scanned_area < area;
+
+  if (max_bx < 0) {
+    motion_box = cv::Rect();
+  } else {
+    motion_box = (block_rect(min_by*cols + min_bx) |
+      block_rect(max_by*cols + max_bx));
+  }
+  if (area == 0)
+    return 0.0;
+  return (double)sum/area;
+}
+
+bool block_scorer::learn(bool triggered)
+{
+  // motion (and the capture after it) says nothing about the usual noise
+  if (triggered)
+    return false;
+  for (int bi : read) {
+    block &b = blocks[bi];
+    const int a = block_rect(bi).area();
+    const bool is_active = b.last_sum > (uint32_t)(SCORE_BLOCK_ACTIVE_DIFF*a);
+    // a plain mean until we have a time constant's worth of frames
+    b.observed++;
+    const float alpha =
+      1.0f/std::min<uint32_t>(b.observed, ACTIVITY_TIME_CONSTANT);
+    b.noise += alpha*((is_active ? 1.0f : 0.0f) - b.noise);
+    b.level += alpha*((float)b.last_sum/a - b.level);
+  }
+  // reclassifying walks every block; once a second is plenty
+  if (frames % 30 != 0)
+    return false;
+  auto old_masked = masked.size(), old_sparse = sparse.size();
+  classify();
+  return masked.size() != old_masked || sparse.size() != old_sparse;
+}
+
+void block_scorer::classify()
+{
+  const size_t max_masked =
+    (size_t)(ACTIVITY_MASK_MAX_FRACTION*blocks.size());
+  size_t n_masked = 0;
+  for (const block &b : blocks)
+    n_masked += b.masked;
+  masked.clear();
+  sparse.clear();
+  unmasked_area = 0;
+  for (int bi = 0; bi < (int)blocks.size(); bi++) {
+    block &b = blocks[bi];
+    const bool learned = b.observed >= (uint32_t)ACTIVITY_TIME_CONSTANT;
+    if (b.masked && b.noise < ACTIVITY_MASK_OFF) {
+      b.masked = false;
+      n_masked--;
+    } else if (!b.masked && learned && b.noise > ACTIVITY_MASK_ON &&
+      n_masked < max_masked)
+    {
+      b.masked = true;
+      n_masked++;
+    }
+    b.sparse = !b.masked && learned &&
+      b.level < ACTIVITY_STATIC_LEVEL && b.noise < ACTIVITY_STATIC_NOISE;
+    if (b.masked) {
+      masked.push_back(bi);
+    } else {
+      unmasked_area += (uint64_t)block_rect(bi).area();
+      if (b.sparse)
+        sparse.push_back(bi);
+    }
+  }
+}
+
+bool block_scorer::save(
+  const std::string &path, int camera, std::string &error) const
+{
+  // write beside it and swap it in so a crash can't leave half a map
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!os) {
+      error = "failed to open file";
+      return false;
+    }
+    activity_map_header amh;
+    std::memcpy(amh.magic, ACTIVITY_MAP_MAGIC, sizeof(amh.magic));
+    amh.version = ACTIVITY_MAP_VERSION;
+    amh.cols = (uint16_t)cols;
+    amh.rows = (uint16_t)rows;
+    amh.block_size = (uint16_t)SCORE_BLOCK_SIZE;
+    amh.camera = (uint16_t)camera;
+    os.write((const char *)&amh, sizeof(amh));
+    for (const block &b : blocks) {
+      activity_map_entry ame { };
+      ame.observed = b.observed;
+      ame.noise = b.noise;
+      ame.level = b.level;
+      ame.masked = b.masked;
+      ame.sparse = b.sparse;
+      os.write((const char *)&ame, sizeof(ame));
+    }
+    if (!os) {
+      error = "write failed";
+      return false;
+    }
+  }
+  fs::rename_overwrite(tmp_path, path, error);
+  return error.empty();
+}
+
+bool block_scorer::load(
+  const std::string &path, int camera, std::string &error)
+{
+  std::ifstream is(path, std::ios::binary);
+  if (!is) {
+    error = "failed to open file";
+    return false;
+  }
+  activity_map_header amh;
+  if (!is.read((char *)&amh, sizeof(amh)) ||
+    std::memcmp(amh.magic, ACTIVITY_MAP_MAGIC, sizeof(amh.magic)) != 0)
+  {
+    error = "not an activity map";
+    return false;
+  } else if (amh.version != ACTIVITY_MAP_VERSION) {
+    error = "unsupported version";
+    return false;
+  } else if (amh.camera != (uint16_t)camera) {
+    error = "map is for camera " + std::to_string(amh.camera);
+    return false;
+  } else if (amh.cols != cols || amh.rows != rows ||
+    amh.block_size != SCORE_BLOCK_SIZE)
+  {
+    error = "map is for another frame size";
+    return false;
+  }
+  std::vector<activity_map_entry> entries(blocks.size());
+  if (!is.read((char *)entries.data(),
+    entries.size()*sizeof(activity_map_entry)))
+  {
+    error = "truncated file";
+    return false;
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    blocks[i].observed = entries[i].observed;
+    blocks[i].noise = entries[i].noise;
+    blocks[i].level = entries[i].level;
+    blocks[i].masked = entries[i].masked != 0;
+    blocks[i].sparse = entries[i].sparse != 0;
+  }
+  classify();
+  return true;
+}
+
+void block_scorer::copy_heatmap(const block_scorer &other)
+{
+  reset(other.frame_size);
+  for (size_t i = 0; i < blocks.size(); i++) {
+    blocks[i].observed = other.blocks[i].observed;
+    blocks[i].noise = other.blocks[i].noise;
+    blocks[i].level = other.blocks[i].level;
+    blocks[i].masked = other.blocks[i].masked;
+    blocks[i].sparse = other.blocks[i].sparse;
+  }
+  classify();
+}
@@ -0,0 +1,109 @@
+#ifndef BLOCKSCORE_HPP
+#define BLOCKSCORE_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// block edge (pixels) for the coarse-to-fine motion score
+static const int SCORE_BLOCK_SIZE = 16;
+// coarse pass stride (in block rows); the first pass sweeps every 4th row of
+// blocks so a large change is seen after a quarter of the frame
+static const int SCORE_BLOCK_STRIDE = 4;
+// a block whose mean difference exceeds this is "active"; active blocks are
+// scored first next frame and make up the motion bounding box
+static const int SCORE_BLOCK_ACTIVE_DIFF = 16;
+// callers that keep quiet scores ask for an exact one this often (frames)
+static const int SCORE_EXACT_PERIOD = 4;
+
+// The activity heatmap learns over about ten minutes of quiet frames (at
+// 30 fps); nothing is masked or thinned until a block has been seen that
+// many times.
+static const int ACTIVITY_TIME_CONSTANT = 30*60*10;
+// a block active in this fraction of quiet frames is masked (noisy) ...
+static const float ACTIVITY_MASK_ON = 0.25f;
+// ... until it drops below this
+static const float ACTIVITY_MASK_OFF = 0.10f;
+// at most this fraction of the frame is ever masked
+static const double ACTIVITY_MASK_MAX_FRACTION = 0.25;
+// a block whose mean difference stays under this (and is almost never
+// active) is static and only read every ACTIVITY_SPARSE_PERIOD frames
+static const float ACTIVITY_STATIC_LEVEL = 2.0f;
+static const float ACTIVITY_STATIC_NOISE = 0.01f;
+static const int ACTIVITY_SPARSE_PERIOD = 4;
+
+// Computes the mean absolute difference between two gray frames block by
+// block, stopping early once the sum so far exceeds threshold*area (it's a
+// trigger) or once even if every remaining pixel differed by 255 it would
+// stay under (it can't reach).  Blocks that were active last frame go first
+// (motion tends to persist), then the rows of blocks in a strided
+// coarse-to-fine order; each row is one sweep down its pixel rows, which
+// reads every cache line once (16 pixels of a row are one SIMD register).
+//
+// When the scan stops early the score returned is a lower bound (the
+// scanned sum over the whole area) and the motion box is partial; it only
+// decides the trigger.  A threshold <= 0 always scores every block, so a
+// caller that needs the score itself (the calibrator, the logs, the ROI)
+// passes 0, e.g. every SCORE_EXACT_PERIOD frames or again on a trigger.
+//
+// learn() keeps a long-term per-block heatmap from quiet (non-triggering)
+// frames.  Blocks that are active in much of the quiet footage (monitors,
+// fans, trees) are masked out of the score; they are still read every
+// ACTIVITY_SPARSE_PERIOD frames so they are unmasked if they settle.
+// Static blocks are read every ACTIVITY_SPARSE_PERIOD frames too; in
+// between their last sum stands in.  save()/load() persist the heatmap.
+struct block_scorer {
+  struct block {
+    uint32_t visited = 0;  // generation this block was last read
+    uint32_t last_sum = 0; // its last difference sum
+    uint32_t observed = 0; // quiet frames learned from
+    float    noise = 0.0f; // fraction of quiet frames it was active in
+    float    level = 0.0f; // mean difference in quiet frames
+    bool     masked = false, sparse = false;
+  };
+
+  cv::Size           frame_size;
+  int                cols = 0, rows = 0; // blocks
+  std::vector<block> blocks;
+  std::vector<int>   row_order;      // the coarse-to-fine block row order
+  std::vector<uint32_t> row_sums;    // scratch for sum_block_row()
+  std::vector<int>   active;         // active blocks (last scored frame)
+  std::vector<int>   masked, sparse; // blocks by class
+  std::vector<int>   read;           // blocks read this frame
+  uint64_t           unmasked_area = 0;
+  uint32_t           generation = 0;
+  uint64_t           frames = 0;
+
+  // results of the last score()
+  int                blocks_scored = 0;
+  bool               early_exit = false; // the score is a lower bound
+  cv::Rect           motion_box;     // bounding box of the active blocks
+
+  // clears everything (including the heatmap) for a frame size
+  void reset(cv::Size sz);
+
+  double score(const cv::Mat &gray, const cv::Mat &background,
+    double threshold);
+  // updates the heatmap from the blocks read by the last score(); returns
+  // true if any block changed class (masked/static)
+  bool learn(bool triggered);
+
+  bool save(const std::string &path, int camera, std::string &error) const;
+  // fails (leaving the heatmap alone) if the file is for another size or
+  // camera
+  bool load(const std::string &path, int camera, std::string &error);
+  // like load() from another scorer's heatmap (and its frame size)
+  void copy_heatmap(const block_scorer &other);
+
+private:
+  cv::Rect block_rect(int block) const;
+  uint32_t block_sum(
+    const cv::Mat &gray, const cv::Mat &background, int block) const;
+  // the sums of a row's blocks that weren't read yet this generation
+  void sum_block_row(const cv::Mat &gray, const cv::Mat &background, int by);
+  void classify();
+};
+
+#endif
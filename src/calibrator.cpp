@@ -0,0 +1,72 @@
+#include "calibrator.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// a perfectly still scene has a MAD near zero; floor the spread so sensor
+// noise alone can't trip the threshold
+static const double CALIBRATION_MIN_MAD_FRACTION = 0.05;
+
+bool online_calibrator::add(double score)
+{
+  float &slot = samples[total % CALIBRATION_WINDOW];
+  if (total >= CALIBRATION_WINDOW) {
+    // evict the oldest sample
+    sorted.erase(std::lower_bound(sorted.begin(), sorted.end(), slot));
+  }
+  slot = (float)score;
+  sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), slot), slot);
+  total++;
+
+  const size_t n = sorted.size();
+  if (n < CALIBRATION_MIN_SAMPLES)
+    return false;
+
+  const size_t mid = n/2;
+  median = sorted[mid];
+
+  // The MAD is the mid'th smallest |x - median|.  Apart from the median
+  // itself (distance 0), the distances form two ascending sequences as we
+  // walk left and right from the median; so we want the (mid-1)'th smallest
+  // of two sorted sequences, which a binary search on how many we take
+  // from the left finds in O(log n).
+  auto left = [&](size_t i) {return median - sorted[mid - 1 - i];};
+  auto right = [&](size_t j) {return sorted[mid + 1 + j] - median;};
+  const size_t nl = mid, nr = n - mid - 1;
+  mad = 0.0;
+  if (mid > 0) {
+    const size_t k = mid; // take this many from the two sequences
+    size_t lo = k > nr ? k - nr : 0, hi = std::min(k, nl);
+    while (lo < hi) {
+      size_t a = (lo + hi)/2, b = k - a;
+      if (b > 0 && right(b - 1) > left(a))
+        lo = a + 1; // take more from the left
+      else
+        hi = a;
+    }
+    size_t a = lo, b = k - lo;
+    mad = std::max(
+      a > 0 ? left(a - 1) : 0.0,
+      b > 0 ? right(b - 1) : 0.0);
+  }
+
+  double spread = std::max(mad, CALIBRATION_MIN_MAD_FRACTION*median);
+  double candidate = median + mad_units*1.4826*spread;
+  if (calibrated() &&
+    std::abs(candidate - threshold) < CALIBRATION_MIN_ADJUSTMENT*threshold)
+  {
+    return false;
+  }
+  threshold = candidate;
+  return true;
+}
+
+std::vector<float> online_calibrator::window() const
+{
+  std::vector<float> w;
+  const uint64_t n = std::min<uint64_t>(total, CALIBRATION_WINDOW);
+  w.reserve((size_t)n);
+  for (uint64_t i = total - n; i < total; i++)
+    w.push_back(samples[i % CALIBRATION_WINDOW]);
+  return w;
+}
@@ -0,0 +1,51 @@
+#ifndef CALIBRATOR_HPP
+#define CALIBRATOR_HPP
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// quiet scores kept for the running statistics (about 34 s at 30 fps)
+static const int CALIBRATION_WINDOW = 1024;
+// quiet scores needed before the first threshold (about 1 s)
+static const int CALIBRATION_MIN_SAMPLES = 32;
+// the threshold only moves (and we only log) if it changes by this fraction
+static const double CALIBRATION_MIN_ADJUSTMENT = 0.02;
+
+// Continuously calibrates the motion threshold from the distribution of
+// non-motion scores without pausing detection.  We keep a window of recent
+// quiet scores and use robust statistics so a single spike can't drag the
+// threshold around:
+//   threshold = median + mad_units * 1.4826 * MAD
+// (1.4826 scales the MAD to a standard deviation for normal data).
+//
+// The window is also kept sorted (an insert and an erase per sample), which
+// makes the median a lookup and the MAD a short walk outward from it; this
+// keeps the per-frame cost around a microsecond so offline replays stay fast.
+struct online_calibrator {
+  double mad_units = 6.0;
+
+  std::array<float,CALIBRATION_WINDOW> samples; // in arrival order
+  uint64_t total = 0;
+  std::vector<float> sorted;
+
+  double median = 0.0;
+  double mad = 0.0;
+  double threshold = 0.0; // the last adjustment; 0.0 until calibrated
+
+  bool calibrated() const {return threshold > 0.0;}
+
+  // forgets the sample window but keeps the current threshold so detection
+  // continues while the window refills
+  void reset() {total = 0; sorted.clear();}
+
+  // adds a score from a frame without motion;
+  // returns true if the threshold was adjusted
+  bool add(double score);
+
+  // the sample window oldest first (adding these to a fresh calibrator
+  // restores this one's statistics)
+  std::vector<float> window() const;
+};
+
+#endif
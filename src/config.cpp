@@ -0,0 +1,241 @@
+#include "mdet.hpp"
+#include "fs.hpp"
+
+#include <csignal>
+
+// how often the watcher looks at the file (and for SIGHUP)
+static const int CONFIG_POLL_MS = 250;
+
+static std::atomic<bool> sighup_received {false};
+
+#ifndef _WIN32
+static void on_sighup(int) {
+  sighup_received = true;
+}
+#endif
+
+static std::string trim(const std::string &s) {
+  size_t b = s.find_first_not_of(" \t\r\n");
+  if (b == std::string::npos)
+    return "";
+  size_t e = s.find_last_not_of(" \t\r\n");
+  return s.substr(b, e - b + 1);
+}
+
+bool read_config_file(const std::string &path, opts &os, std::string &error)
+{
+  std::ifstream ifs(path);
+  if (!ifs) {
+    error = path + ": failed to open config file";
+    return false;
+  }
+  opts next = os; // all or nothing
+  std::string line;
+  int line_no = 0;
+  while (std::getline(ifs, line)) {
+    line_no++;
+    auto hash = line.find('#');
+    if (hash != std::string::npos)
+      line = line.substr(0, hash);
+    line = trim(line);
+    if (line.empty())
+      continue;
+
+    std::stringstream where;
+    where << path << ":" << line_no << ": ";
+    auto eq = line.find('=');
+    if (eq == std::string::npos) {
+      error = where.str() + "expected key = value";
+      return false;
+    }
+    const std::string key = trim(line.substr(0, eq));
+    const std::string value = trim(line.substr(eq + 1));
+    try {
+      if (key == "calibration-mads") {
+        next.calibration_mad_units = std::stod(value);
+        if (next.calibration_mad_units <= 0.0)
+          throw std::invalid_argument("must be positive");
+      } else if (key == "detector") {
+        std::string detector_error;
+        if (!create_detector(value, detector_error))
+          throw std::invalid_argument("unknown detector");
+        next.detector = value;
+      } else if (key == "fps") {
+        next.fps = std::stod(value);
+        if (next.fps <= 0.0 || next.fps > 240.0)
+          throw std::invalid_argument("must be in (0,240]");
+      } else if (key == "max-video-length") {
+        next.max_video_length = std::stoi(value);
+      } else if (key == "max-videos") {
+        next.max_videos = std::stoi(value);
+        if (next.max_videos <= 0)
+          throw std::invalid_argument("must be positive");
+      } else if (key == "motion-mask-scale") {
+        next.motion_mask_scale = std::stoi(value);
+        if (next.motion_mask_scale < 0)
+          throw std::invalid_argument("must be non-negative");
+      } else if (key == "motion-threshold") {
+        if (value == "auto") {
+          next.has_custom_motion_threshold = false;
+        } else {
+          next.motion_threshold = std::stod(value);
+          next.has_custom_motion_threshold = true;
+        }
+      } else if (key == "remote-copy") {
+        next.remote_copy_dir = value;
+      } else {
+        error = where.str() + key + ": unknown (or not reloadable) key";
+        return false;
+      }
+    } catch (const std::invalid_argument &ia) {
+      error = where.str() + key + ": " + ia.what();
+      return false;
+    } catch (const std::out_of_range &) {
+      error = where.str() + key + ": value out of range";
+      return false;
+    }
+  }
+  os = next;
+  return true;
+}
+
+static void run_config_watcher(config_watcher *cw) {
+  cw->run();
+}
+
+config_watcher::config_watcher(const opts &os)
+  : path(os.config_path)
+  , current(os)
+  , last_write_time(fs::last_write_time(os.config_path))
+{
+#ifndef _WIN32
+  std::signal(SIGHUP, on_sighup);
+#endif
+  thread = std::thread(run_config_watcher, this);
+}
+
+config_watcher::~config_watcher() {
+  exit_watcher = true;
+  thread.join();
+  save_retired(); // (too late to log a failure)
+}
+
+std::unique_ptr<config_update> config_watcher::take() {
+  std::lock_guard<std::mutex> lk(mutex);
+  has_pending = false;
+  return std::move(pending);
+}
+
+void config_watcher::set_frame_size(cv::Size sz) {
+  std::lock_guard<std::mutex> lk(mutex);
+  frame_size = sz;
+}
+
+void config_watcher::retire(std::unique_ptr<detector> d) {
+  std::lock_guard<std::mutex> lk(mutex);
+  retired = std::move(d); // (one not yet saved is older)
+}
+
+void config_watcher::run() {
+  enter_thread_role(THREAD_CONFIG);
+  int64_t seen_write_time = last_write_time;
+  while (!exit_watcher) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(CONFIG_POLL_MS));
+    save_retired();
+    // editors often write in several steps; so a change must hold for a
+    // poll before we read it
+    int64_t t = fs::last_write_time(path);
+    bool changed = t != -1 && t != last_write_time && t == seen_write_time;
+    seen_write_time = t;
+    if (sighup_received.exchange(false) || changed) {
+      last_write_time = t;
+      reload();
+    }
+  }
+}
+
+void config_watcher::reload() {
+  std::unique_ptr<config_update> cu(new config_update());
+  cu->os = current;
+  if (!read_config_file(path, cu->os, cu->error))
+    cu->os = current;
+  // the slow parts happen here rather than on the detection thread
+  if (cu->error.empty() && cu->os.detector != current.detector) {
+    cu->new_detector = create_detector(cu->os.detector, cu->error);
+    if (!cu->new_detector)
+      cu->os.detector = current.detector;
+    else
+      load_activity_map(*cu);
+  }
+  if (cu->error.empty() && !cu->os.remote_copy_dir.empty() &&
+    cu->os.remote_copy_dir != current.remote_copy_dir)
+  {
+    fs::create_directory_if_absent(
+      fs::join_path(cu->os.remote_copy_dir, cu->os.motion_video_dir),
+      cu->error);
+    if (!cu->error.empty())
+      cu->os.remote_copy_dir = current.remote_copy_dir;
+  }
+  current = cu->os;
+
+  std::lock_guard<std::mutex> lk(mutex);
+  // a newer update replaces one not yet taken (but keeps its detector)
+  if (pending && pending->new_detector && !cu->new_detector &&
+    pending->os.detector == cu->os.detector)
+  {
+    cu->new_detector = std::move(pending->new_detector);
+    cu->activity_map_note = std::move(pending->activity_map_note);
+  }
+  if (pending)
+    cu->notes.insert(cu->notes.begin(),
+      pending->notes.begin(), pending->notes.end());
+  pending = std::move(cu);
+  has_pending = true;
+}
+
+void config_watcher::load_activity_map(config_update &cu) {
+  block_scorer *blocks = cu.new_detector->blocks();
+  cv::Size sz;
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    sz = frame_size;
+  }
+  // until the detection thread has a background it loads the map itself
+  if (!blocks || sz.area() == 0)
+    return;
+  blocks->reset(sz);
+  if (current.activity_map_path.empty())
+    return;
+  std::string error;
+  if (!blocks->load(current.activity_map_path, current.camera, error)) {
+    cu.activity_map_note = concat(current.activity_map_path,": ",error,
+      " (learning a new activity map)");
+    return;
+  }
+  cu.activity_map_note = concat(current.activity_map_path,
+    ": loaded activity map (",blocks->masked.size()," noisy blocks masked, ",
+    blocks->sparse.size()," static)");
+}
+
+void config_watcher::save_retired() {
+  std::unique_ptr<detector> d;
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    d = std::move(retired);
+  }
+  block_scorer *blocks = d ? d->blocks() : nullptr;
+  if (!blocks || blocks->blocks.empty() || current.activity_map_path.empty())
+    return;
+  std::string error;
+  if (blocks->save(current.activity_map_path, current.camera, error))
+    return;
+  // the detection thread logs it with the next update (made here if none)
+  std::lock_guard<std::mutex> lk(mutex);
+  if (!pending) {
+    pending.reset(new config_update());
+    pending->os = current;
+  }
+  pending->notes.push_back(concat(current.activity_map_path,": WARNING: ",
+    error," (activity map not saved)"));
+  has_pending = true;
+}
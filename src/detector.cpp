@@ -0,0 +1,163 @@
+#include "mdet.hpp"
+
+#include <opencv2/video/video.hpp>
+
+// the blur the original detector (and the motion mask files) use
+static const cv::Size DETECTOR_BLUR(21,21);
+// how fast running-average absorbs quiet frames (about 2 s at 30 fps)
+static const double RUNNING_AVERAGE_RATE = 0.02;
+
+static void blurred_gray(
+  const image &color_frame, image &gray, image &dst, perf_profiler *perf)
+{
+  {
+    perf_scope ps(perf, PERF_CONVERT);
+    cv::cvtColor(color_frame, gray, cv::COLOR_BGR2GRAY);
+  }
+  perf_scope ps(perf, PERF_BLUR);
+  cv::GaussianBlur(gray, dst, DETECTOR_BLUR, 0.0);
+}
+
+// https://www.pyimagesearch.com/2015/05/25/basic-motion-detection-and-tracking-with-python-and-opencv/
+struct blur_absdiff_detector : detector {
+  image        gray, blurred, background;
+  block_scorer block_score;
+
+  const char *name() const override {return "blur-absdiff";}
+  void reset(const image &color_frame) override {
+    blurred_gray(color_frame, gray, background, nullptr);
+  }
+  bool learn(bool triggered) override {
+    return block_score.learn(triggered);
+  }
+  void motion_image(image &dst) const override {
+    // scoring works in blocks and stops early; so make the image here
+    cv::absdiff(blurred, background, dst);
+  }
+  cv::Rect motion_box() const override {return block_score.motion_box;}
+  block_scorer *blocks() override {return &block_score;}
+
+protected:
+  double score_frame(const image &color_frame, double threshold) override {
+    blurred_gray(color_frame, gray, blurred, perf);
+    perf_scope ps(perf, PERF_DIFF);
+    return block_score.score(blurred, background, threshold);
+  }
+};
+
+struct running_average_detector : blur_absdiff_detector {
+  image background_f; // CV_32F; background is this rounded to 8 bits
+
+  const char *name() const override {return "running-average";}
+  void reset(const image &color_frame) override {
+    blur_absdiff_detector::reset(color_frame);
+    background.convertTo(background_f, CV_32F);
+  }
+  bool learn(bool triggered) override {
+    if (!triggered) {
+      cv::accumulateWeighted(blurred, background_f, RUNNING_AVERAGE_RATE);
+      background_f.convertTo(background, CV_8U);
+    }
+    return blur_absdiff_detector::learn(triggered);
+  }
+};
+
+struct subtractor_detector : detector {
+  const char                        *algorithm;
+  cv::Ptr<cv::BackgroundSubtractor>  subtractor;
+  image                              foreground;
+
+  subtractor_detector(const char *a) : algorithm(a) { }
+
+  const char *name() const override {return algorithm;}
+  void reset(const image &color_frame) override {
+    // shadow detection roughly doubles the cost; we only want a score
+    if (std::string(algorithm) == "knn")
+      subtractor = cv::createBackgroundSubtractorKNN(500, 400.0, false);
+    else
+      subtractor = cv::createBackgroundSubtractorMOG2(500, 16.0, false);
+    subtractor->apply(color_frame, foreground, 1.0);
+  }
+  void motion_image(image &dst) const override {foreground.copyTo(dst);}
+
+protected:
+  double score_frame(const image &color_frame, double) override {
+    // the model update and the comparison are one call
+    perf_scope ps(perf, PERF_DIFF);
+    subtractor->apply(color_frame, foreground);
+    return cv::mean(foreground)[0];
+  }
+};
+
+struct block_hash_detector : detector {
+  image    small_color, signature, background, diff;
+  cv::Rect box;
+
+  const char *name() const override {return "block-hash";}
+  void reset(const image &color_frame) override {
+    make_signature(color_frame, background, nullptr);
+  }
+  void motion_image(image &dst) const override {
+    cv::resize(diff, dst,
+      cv::Size(diff.cols*SCORE_BLOCK_SIZE, diff.rows*SCORE_BLOCK_SIZE),
+      0, 0, cv::INTER_NEAREST);
+  }
+  cv::Rect motion_box() const override {return box;}
+
+protected:
+  void make_signature(
+    const image &color_frame, image &dst, perf_profiler *profiler)
+  {
+    perf_scope ps(profiler, PERF_CONVERT);
+    // downscale first; converting the small image to gray is nearly free
+    cv::resize(color_frame, small_color,
+      cv::Size(
+        (color_frame.cols + SCORE_BLOCK_SIZE - 1)/SCORE_BLOCK_SIZE,
+        (color_frame.rows + SCORE_BLOCK_SIZE - 1)/SCORE_BLOCK_SIZE),
+      0, 0, cv::INTER_AREA);
+    cv::cvtColor(small_color, dst, cv::COLOR_BGR2GRAY);
+  }
+  double score_frame(const image &color_frame, double) override {
+    make_signature(color_frame, signature, perf);
+    perf_scope ps(perf, PERF_DIFF);
+    cv::absdiff(signature, background, diff);
+    int min_x = diff.cols, min_y = diff.rows, max_x = -1, max_y = -1;
+    for (int y = 0; y < diff.rows; y++) {
+      const uint8_t *row = diff.ptr<uint8_t>(y);
+      for (int x = 0; x < diff.cols; x++) {
+        if (row[x] > SCORE_BLOCK_ACTIVE_DIFF) {
+          min_x = std::min(min_x, x);
+          max_x = std::max(max_x, x);
+          min_y = std::min(min_y, y);
+          max_y = std::max(max_y, y);
+        }
+      }
+    }
+    box = max_x < 0 ? cv::Rect() :
+      cv::Rect(
+        min_x*SCORE_BLOCK_SIZE, min_y*SCORE_BLOCK_SIZE,
+        (max_x - min_x + 1)*SCORE_BLOCK_SIZE,
+        (max_y - min_y + 1)*SCORE_BLOCK_SIZE);
+    return cv::mean(diff)[0];
+  }
+};
+
+std::unique_ptr<detector> create_detector(
+  const std::string &name, std::string &error)
+{
+  std::unique_ptr<detector> d;
+  if (name == "blur-absdiff") {
+    d.reset(new blur_absdiff_detector());
+  } else if (name == "running-average") {
+    d.reset(new running_average_detector());
+  } else if (name == "mog2") {
+    d.reset(new subtractor_detector("mog2"));
+  } else if (name == "knn") {
+    d.reset(new subtractor_detector("knn"));
+  } else if (name == "block-hash") {
+    d.reset(new block_hash_detector());
+  } else {
+    error = name + ": unknown detector";
+  }
+  return d;
+}
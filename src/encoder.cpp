@@ -0,0 +1,142 @@
+#include "mdet.hpp"
+#include "fs.hpp"
+
+// http://www.fourcc.org/codecs.php
+static const char* FOUR_CCS[] {
+  "H264",
+  "X264",
+  "XVID",
+  "MP4V",
+};
+
+static int to_fourcc(const char *ccs) {
+  return cv::VideoWriter::fourcc(ccs[0], ccs[1], ccs[2], ccs[3]);
+}
+
+static void run_warm_video_writer(warm_video_writer *wvw) {
+  wvw->run();
+}
+
+warm_video_writer::warm_video_writer(
+  std::string _file_name,
+  int _four_cc,
+  double _fps,
+  cv::Size _frame_size)
+    : file_name(_file_name)
+    , four_cc(_four_cc)
+    , fps(_fps)
+    , frame_size(_frame_size)
+    , thread(run_warm_video_writer, this)
+{
+}
+
+void warm_video_writer::run() {
+  enter_thread_role(THREAD_WRITER);
+  // a stale video from an earlier run (or the last rotation) may be here
+  fs::remove_if_exists(file_name);
+  vw.open(file_name, four_cc, fps, frame_size, true);
+  done = true;
+}
+
+std::string motion_detector::video_file_stem(int video_index) const {
+  std::stringstream ss;
+  ss << "motion" << std::setw(5) << std::setfill('0') << video_index;
+  return fs::join_path(os.motion_video_dir,ss.str());
+}
+
+void motion_detector::probe_video_codecs() {
+  // opening a writer for a codec that isn't there can take a while to fail,
+  // so we find a working one once rather than on every trigger
+  auto probe_file = fs::join_path(os.motion_video_dir,"mdet-probe.mp4");
+  const auto &frame = color_frames.newest();
+
+  auto probe = [&] (const char *ccs) {
+    auto probe_started = now();
+    cv::VideoWriter vw;
+    bool ok = vw.open(probe_file, to_fourcc(ccs), os.fps,
+      frame.size(), true) && vw.isOpened();
+    if (ok)
+      vw.write(frame);
+    vw.release();
+    fs::remove_if_exists(probe_file);
+    auto elapsed =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        now() - probe_started);
+    log("probing video codec ",ccs,": ",ok ? "ok" : "unavailable",
+      " (",format(elapsed.count()/1000.0,0,1)," ms)");
+    if (ok) {
+      video_fourcc = to_fourcc(ccs);
+      video_fourcc_name = ccs;
+    }
+    return ok;
+  };
+
+  if (!os.preferred_fourcc.empty() && probe(os.preferred_fourcc.c_str()))
+    return;
+  for (const char *ccs : FOUR_CCS) {
+    if (probe(ccs))
+      return;
+  }
+  log("WARNING: no video codec probed successfully; "
+    "captures will retry all of them");
+}
+
+bool motion_detector::open_video_writer(
+  cv::VideoWriter &vw, const std::string &file_name, cv::Size frame_size)
+{
+  auto open_video_output =
+    [&](int four_cc)
+    {
+      vw.open(
+        file_name,
+        four_cc,
+        os.fps,
+        frame_size,
+        true);
+      return vw.isOpened();
+    };
+
+  if (video_fourcc != -1 && open_video_output(video_fourcc)) {
+    log("opened video (in ",video_fourcc_name,")");
+    return true;
+  }
+  log("falling back to other formats");
+  if (!os.preferred_fourcc.empty() &&
+    open_video_output(to_fourcc(os.preferred_fourcc.c_str())))
+  {
+    log("opened video (in preferred format)");
+    return true;
+  }
+  for (const char *ccs : FOUR_CCS) {
+    log("trying ", ccs);
+    if (open_video_output(to_fourcc(ccs))) {
+      log("opened video (in ",ccs,")");
+      return true;
+    }
+  }
+  return false;
+}
+
+void motion_detector::prepare_warm_writer() {
+  discard_warm_writer();
+  if (video_fourcc == -1 || os.max_video_length <= 0 ||
+    next_video_index - first_video_index >= os.max_videos)
+  {
+    return;
+  }
+  warm_writer.reset(new warm_video_writer(
+    video_file_stem(next_video_index) + ".mp4",
+    video_fourcc,
+    os.fps,
+    color_frames.newest().size()));
+}
+
+void motion_detector::discard_warm_writer() {
+  if (!warm_writer)
+    return;
+  warm_writer->thread.join();
+  // the file only has a header; don't leave it lying around
+  warm_writer->vw.release();
+  storage->remove_async(warm_writer->file_name);
+  warm_writer.reset();
+}
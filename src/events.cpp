@@ -0,0 +1,264 @@
+#include "events.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+int64_t event_time_now()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string format_event_time(int64_t time_us)
+{
+  time_t tt = (time_t)(time_us / 1000000);
+  struct tm t;
+#ifdef _MSC_VER
+  ::localtime_s(&t, &tt);
+#else
+  ::localtime_r(&tt, &t);
+#endif
+  char tbuf[128];
+  std::strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &t);
+  std::stringstream ss;
+  ss << tbuf << "." <<
+    std::setw(3) << std::setfill('0') << (time_us % 1000000) / 1000;
+  return ss.str();
+}
+
+bool parse_event_time(const std::string &s, int64_t &time_us)
+{
+  if (!s.empty() &&
+    std::all_of(s.begin(), s.end(), [](char c){return c >= '0' && c <= '9';}))
+  {
+    try {
+      time_us = (int64_t)std::stoll(s) * 1000000;
+      return true;
+    } catch (...) {
+      return false;
+    }
+  }
+
+  std::string str = s;
+  std::replace(str.begin(), str.end(), 'T', ' ');
+  struct tm t;
+  memset(&t, 0, sizeof(t));
+  const char *FORMATS[] {
+    "%Y-%m-%d %H:%M:%S",
+    "%Y-%m-%d %H:%M",
+    "%Y-%m-%d",
+  };
+  for (const char *fmt : FORMATS) {
+    std::istringstream iss(str);
+    memset(&t, 0, sizeof(t));
+    iss >> std::get_time(&t, fmt);
+    if (!iss.fail() && iss.peek() == std::char_traits<char>::eof()) {
+      t.tm_isdst = -1; // let mktime figure out daylight savings
+      time_t tt = std::mktime(&t);
+      if (tt == (time_t)-1)
+        return false;
+      time_us = (int64_t)tt * 1000000;
+      return true;
+    }
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void event_index_writer::open(const std::string &_path, std::string &error)
+{
+  path = _path;
+  // a crash mid-append leaves a torn record; appending after it would
+  // misalign every later record, so cut it off (or the torn header)
+  const int64_t size = fs::file_size(path);
+  if (size >= (int64_t)sizeof(event_index_header)) {
+    // an older index may be out of order; don't add to it
+    event_index_header eih;
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs.read((char *)&eih, sizeof(eih)) ||
+      memcmp(eih.magic, EVENT_INDEX_MAGIC, sizeof(eih.magic)) != 0 ||
+      eih.version != EVENT_INDEX_VERSION ||
+      eih.record_size != sizeof(event_record))
+    {
+      error = "not an event index of this version";
+      return;
+    }
+  }
+  if (size > 0) {
+    int64_t whole = 0;
+    if (size >= (int64_t)sizeof(event_index_header)) {
+      whole = sizeof(event_index_header) +
+        (size - sizeof(event_index_header))/sizeof(event_record)*
+          sizeof(event_record);
+    }
+    if (whole != size) {
+      fs::resize_file(path, (uint64_t)whole, error);
+      if (!error.empty())
+        return;
+    }
+  }
+  stream.open(path, std::ios::binary | std::ios::app);
+  if (!stream.is_open()) {
+    error = "failed to open event index";
+    return;
+  }
+  stream.seekp(0, std::ios::end);
+  if (stream.tellp() == std::streampos(0)) {
+    event_index_header eih;
+    memcpy(eih.magic, EVENT_INDEX_MAGIC, sizeof(eih.magic));
+    eih.version = EVENT_INDEX_VERSION;
+    eih.record_size = sizeof(event_record);
+    stream.write((const char *)&eih, sizeof(eih));
+    stream.flush();
+  }
+}
+
+int64_t event_index_writer::append(event_record er)
+{
+  if (!stream.is_open())
+    return -1;
+  // readers count on the lag being bounded (a stalled write is late)
+  er.time_us = std::max(er.time_us, event_time_now() - EVENT_INDEX_MAX_LAG_US);
+  // events are rare; flush so a crash doesn't lose them
+  stream.write((const char *)&er, sizeof(er));
+  stream.flush();
+  // (appends leave the position after our own record)
+  const int64_t end = (int64_t)stream.tellp();
+  return stream && end >= (int64_t)sizeof(er) ? end - (int64_t)sizeof(er) : -1;
+}
+
+void event_index_writer::update(int64_t offset, const event_record &er)
+{
+  if (offset < 0)
+    return;
+  // the time stays as appended (it may have been clamped)
+  std::ofstream ofs(path, std::ios::binary | std::ios::in | std::ios::out);
+  ofs.seekp(offset + sizeof(er.time_us));
+  ofs.write((const char *)&er + sizeof(er.time_us),
+    sizeof(er) - sizeof(er.time_us));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool event_index_reader::open(const std::string &path, std::string &error)
+{
+  if (!file.open(path, error))
+    return false;
+  if (file.size < sizeof(event_index_header)) {
+    error = "truncated event index header";
+    return false;
+  }
+  const auto *eih = (const event_index_header *)file.data;
+  if (memcmp(eih->magic, EVENT_INDEX_MAGIC, sizeof(eih->magic)) != 0) {
+    error = "not an event index (bad magic)";
+    return false;
+  } else if (eih->version != EVENT_INDEX_VERSION ||
+    eih->record_size != sizeof(event_record))
+  {
+    error = "unsupported event index version";
+    return false;
+  }
+  records = (const event_record *)(file.data + sizeof(event_index_header));
+  num_records =
+    (file.size - sizeof(event_index_header)) / sizeof(event_record);
+  return true;
+}
+
+void event_index_reader::find_range(
+  int64_t from_us, int64_t to_us, size_t &lo, size_t &hi) const
+{
+  // Records are only sorted to within the lag, so this bisects by hand
+  // (std::lower_bound wants a partitioned range).  It stops between a
+  // record under t and one at or over it.  Every record before one under
+  // from - lag is under from, and every record after one at or over
+  // to + lag is at or over to; so [lo,hi) holds all the matches.
+  auto bisect = [&] (size_t first, int64_t t) {
+    size_t count = num_records - first;
+    while (count > 0) {
+      const size_t half = count/2;
+      if (records[first + half].time_us < t) {
+        first += half + 1;
+        count -= half + 1;
+      } else {
+        count = half;
+      }
+    }
+    return first;
+  };
+  lo = from_us == INT64_MIN ? 0 : bisect(0, from_us - EVENT_INDEX_MAX_LAG_US);
+  hi = to_us == INT64_MAX ? num_records :
+    bisect(lo, to_us + EVENT_INDEX_MAX_LAG_US);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int run_event_query(const event_query &eq)
+{
+  auto query_started = std::chrono::steady_clock::now();
+
+  event_index_reader eir;
+  std::string error;
+  if (!eir.open(eq.path, error)) {
+    std::cerr << eq.path << ": " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  size_t lo = 0, hi = 0;
+  eir.find_range(eq.from_us, eq.to_us, lo, hi);
+
+  std::vector<const event_record *> in_range;
+  for (size_t i = lo; i < hi; i++) {
+    const event_record &er = eir.records[i];
+    if (er.time_us >= eq.from_us && er.time_us < eq.to_us)
+      in_range.push_back(&er);
+  }
+  // (within the lag they may be out of order)
+  std::stable_sort(in_range.begin(), in_range.end(),
+    [](const event_record *a, const event_record *b) {
+      return a->time_us < b->time_us;
+    });
+
+  std::stringstream ss;
+  size_t matched = 0;
+  for (const event_record *ep : in_range) {
+    const event_record &er = *ep;
+    if (er.peak_score < eq.min_score)
+      continue;
+    if (eq.camera >= 0 && er.camera != eq.camera)
+      continue;
+    matched++;
+    ss << format_event_time(er.time_us) <<
+      "  camera " << er.camera <<
+      "  score " << std::fixed << std::setprecision(3) << er.peak_score <<
+      " (threshold " << er.threshold << ")";
+    if (er.zone >= 0)
+      ss << "  zone " << er.zone;
+    if (er.video_index >= 0) {
+      ss << "  ";
+      const uint32_t dir = er.flags >> EVENT_FLAG_DIR_SHIFT;
+      if (dir != 0)
+        ss << "logs" << std::setw(5) << std::setfill('0') << (dir - 1) << "/";
+      ss << "motion" <<
+        std::setw(5) << std::setfill('0') << er.video_index << ".mp4" <<
+        std::setfill(' ') << " @ frame " << er.frame_offset;
+      if (er.flags & EVENT_FLAG_ROI_VIDEO)
+        ss << " (+roi)";
+      if (er.flags & EVENT_FLAG_THUMBNAILS)
+        ss << " (+thumbnails)";
+    }
+    ss << "\n";
+  }
+  std::cout << ss.str();
+
+  auto elapsed_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - query_started).count();
+  std::cout << matched << " event(s); scanned " << (hi - lo) <<
+    " of " << eir.num_records << " records in " <<
+    std::fixed << std::setprecision(3) << elapsed_us/1000.0 << " ms\n";
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+#ifndef EVENTS_HPP
+#define EVENTS_HPP
+
+#include "fs.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// The motion event index is an append-only binary file of fixed-size
+// records behind a small header.  A record goes in when its event triggers
+// and is completed in place once its clip (and with --thumbnails its JPEGs)
+// is written.  Each record is appended within EVENT_INDEX_MAX_LAG_US of its
+// time_us (the writer clamps a late one), so even with several processes
+// appending no record is more than that older than one before it.  A
+// reader memory maps the file and binary searches on the timestamp,
+// widening the range by that much.
+//
+// A torn trailing record (e.g. we crash mid-write) is ignored by readers
+// and cut off by the next writer.
+
+static const char     EVENT_INDEX_MAGIC[8] = {'M','D','E','V','I','D','X','\0'};
+static const uint32_t EVENT_INDEX_VERSION = 2; // 2 bounded the lag
+static const int64_t  EVENT_INDEX_MAX_LAG_US = 1000*1000;
+
+struct event_index_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+static_assert(sizeof(event_index_header) == 16, "unexpected header size");
+
+struct event_record {
+  int64_t  time_us;      // microseconds since the Unix epoch (system_clock)
+  float    peak_score;   // highest adiff_ratio seen in the event
+  float    threshold;    // motion_threshold when the event fired
+  uint16_t camera;       // opts::camera
+  int16_t  zone;         // -1 means the entire frame
+  int32_t  video_index;  // motion#####.mp4; -1 if no video was written
+  uint32_t frame_offset; // frame within the video of the peak score
+  uint32_t flags;        // EVENT_FLAG_*
+};
+static_assert(sizeof(event_record) == 32, "unexpected record size");
+
+static const uint32_t EVENT_FLAG_ROI_VIDEO  = 0x1; // motion#####-roi.mp4 too
+// motion#####-{trigger,peak,last,sheet}.jpg
+static const uint32_t EVENT_FLAG_THUMBNAILS = 0x2;
+// the high half of the flags is the --log-rotate directory's number + 1
+// (logs#####; 0 for --motion-video-dir)
+static const int EVENT_FLAG_DIR_SHIFT = 16;
+
+int64_t event_time_now();
+
+// e.g. "2019-02-11 02:14:07.123" (local time)
+std::string format_event_time(int64_t time_us);
+// accepts "YYYY-MM-DD[ HH:MM[:SS]]" (local time, 'T' may separate date and
+// time) or a raw integer number of seconds since the epoch;
+// returns false on a malformed value
+bool parse_event_time(const std::string &s, int64_t &time_us);
+
+struct event_index_writer {
+  std::string   path;
+  std::ofstream stream;
+
+  // opens (or creates) the index for appending; on failure error is set
+  void open(const std::string &_path, std::string &error);
+  bool is_open() const {return stream.is_open();}
+  // returns the record's offset (-1 if it wasn't written)
+  int64_t append(event_record er);
+  // rewrites an appended record but for its time_us
+  void update(int64_t offset, const event_record &er);
+};
+
+struct event_index_reader {
+  fs::mapped_file file;
+  const event_record *records = nullptr;
+  size_t              num_records = 0;
+
+  bool open(const std::string &path, std::string &error);
+
+  // an index range [lo,hi) holding every record with time_us in
+  // [from_us,to_us) (and a few around it; the caller checks each one's time)
+  void find_range(int64_t from_us, int64_t to_us, size_t &lo, size_t &hi) const;
+};
+
+struct event_query {
+  std::string path;
+  int64_t     from_us = INT64_MIN;
+  int64_t     to_us = INT64_MAX;
+  double      min_score = 0.0;
+  int         camera = -1; // -1 means all cameras
+};
+
+// runs a query emitting results to stdout; returns the process exit code
+int run_event_query(const event_query &eq);
+
+#endif
@@ -0,0 +1,321 @@
+#include "framebus.hpp"
+
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static size_t round_up(size_t n, size_t a) {
+  return (n + a - 1)/a*a;
+}
+
+#ifdef _WIN32
+// "Local\" keeps it in this session's namespace
+static std::string mapping_name(const std::string &name) {
+  return "Local\\" + name;
+}
+#else
+// POSIX names are a single leading / and no others
+static std::string mapping_name(const std::string &name) {
+  return name.size() > 0 && name[0] == '/' ? name : "/" + name;
+}
+
+// the producer of an existing object if it's still running (else 0)
+static uint32_t live_producer(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return 0;
+  uint32_t pid = 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(frame_bus_header)) {
+    void *ptr = mmap(nullptr, sizeof(frame_bus_header), PROT_READ,
+      MAP_SHARED, fd, 0);
+    if (ptr != MAP_FAILED) {
+      const auto *h = (const frame_bus_header *)ptr;
+      if (std::memcmp(h->magic, FRAME_BUS_MAGIC, sizeof(h->magic)) == 0)
+        pid = h->producer_pid;
+      munmap(ptr, sizeof(frame_bus_header));
+    }
+  }
+  ::close(fd);
+  // EPERM means it runs as another user
+  if (pid != 0 && kill((pid_t)pid, 0) != 0 && errno == ESRCH)
+    pid = 0;
+  return pid;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// writer
+bool frame_bus_writer::open(
+  const std::string &_name, int width, int height, int slots,
+  std::string &error)
+{
+  close();
+  const size_t stride = round_up((size_t)width*3, 64);
+  const size_t slot_bytes =
+    round_up(sizeof(frame_bus_slot) + stride*height, 64);
+  const size_t total = sizeof(frame_bus_header) + slot_bytes*slots;
+  name = mapping_name(_name);
+
+  void *ptr = nullptr;
+#ifdef _WIN32
+  HANDLE mh = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr,
+    PAGE_READWRITE, (DWORD)((uint64_t)total >> 32), (DWORD)total,
+    name.c_str());
+  if (mh == nullptr) {
+    error = "CreateFileMapping failed";
+    return false;
+  }
+  // the mapping lives while any handle does; so it's another producer's
+  if (GetLastError() == ERROR_ALREADY_EXISTS) {
+    CloseHandle(mh);
+    error = "in use by another process";
+    return false;
+  }
+  ptr = MapViewOfFile(mh, FILE_MAP_ALL_ACCESS, 0, 0, total);
+  if (ptr == nullptr) {
+    CloseHandle(mh);
+    error = "MapViewOfFile failed";
+    return false;
+  }
+  mapping_handle = mh;
+  const uint32_t pid = (uint32_t)GetCurrentProcessId();
+#else
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0 && errno == EEXIST) {
+    const uint32_t other = live_producer(name);
+    if (other != 0) {
+      error = "in use by process " + std::to_string(other);
+      return false;
+    }
+    // a stale object from a crashed run would have the wrong layout
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  }
+  if (fd < 0) {
+    error = "shm_open failed";
+    return false;
+  }
+  if (ftruncate(fd, (off_t)total) != 0) {
+    ::close(fd);
+    shm_unlink(name.c_str());
+    error = "ftruncate failed";
+    return false;
+  }
+  ptr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    error = "mmap failed";
+    return false;
+  }
+  const uint32_t pid = (uint32_t)getpid();
+#endif
+  size = total;
+
+  // readers check the magic last; so fill everything else in first
+  std::memset(ptr, 0, sizeof(frame_bus_header));
+  header = new (ptr) frame_bus_header();
+  header->version = FRAME_BUS_VERSION;
+  header->slots = (uint32_t)slots;
+  header->width = (uint32_t)width;
+  header->height = (uint32_t)height;
+  header->stride = (uint32_t)stride;
+  header->producer_pid = pid;
+  header->slot_bytes = slot_bytes;
+  for (int i = 0; i < slots; i++) {
+    uint8_t *s = (uint8_t *)ptr + sizeof(frame_bus_header) + i*slot_bytes;
+    new (s) frame_bus_slot();
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(header->magic, FRAME_BUS_MAGIC, sizeof(header->magic));
+  return true;
+}
+
+void frame_bus_writer::close()
+{
+  if (!header)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(header);
+  CloseHandle((HANDLE)mapping_handle);
+  mapping_handle = nullptr;
+#else
+  munmap(header, size);
+  // readers keep their mapping until they notice the heartbeat stopped
+  shm_unlink(name.c_str());
+#endif
+  header = nullptr;
+}
+
+uint8_t *frame_bus_writer::pixels(int slot) const
+{
+  return (uint8_t *)header + sizeof(frame_bus_header) +
+    slot*header->slot_bytes + sizeof(frame_bus_slot);
+}
+
+void frame_bus_writer::begin(uint64_t seq)
+{
+  auto *s = (frame_bus_slot *)(pixels((int)((seq - 1) % header->slots)) -
+    sizeof(frame_bus_slot));
+  s->lock.store(2*seq - 1, std::memory_order_relaxed);
+  // keep the pixel writes after the lock changes
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void frame_bus_writer::publish(uint64_t seq, const frame_bus_metadata &md)
+{
+  auto *s = (frame_bus_slot *)(pixels((int)((seq - 1) % header->slots)) -
+    sizeof(frame_bus_slot));
+  s->metadata = md;
+  s->lock.store(2*seq, std::memory_order_release);
+  header->heartbeat_us.store(md.time_us, std::memory_order_relaxed);
+  header->published.store(seq, std::memory_order_release);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// reader
+bool frame_bus_reader::open(const std::string &_name, std::string &error)
+{
+  close();
+  const std::string name = mapping_name(_name);
+  const void *ptr = nullptr;
+#ifdef _WIN32
+  HANDLE mh = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+  if (mh == nullptr) {
+    error = "no such frame bus (is mdet running with --frame-bus?)";
+    return false;
+  }
+  ptr = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+  if (ptr == nullptr) {
+    CloseHandle(mh);
+    error = "MapViewOfFile failed";
+    return false;
+  }
+  MEMORY_BASIC_INFORMATION mbi;
+  VirtualQuery(ptr, &mbi, sizeof(mbi));
+  size = mbi.RegionSize;
+  mapping_handle = mh;
+#else
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    error = "no such frame bus (is mdet running with --frame-bus?)";
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    error = "fstat failed";
+    return false;
+  }
+  size = (size_t)st.st_size;
+  ptr = size == 0 ? MAP_FAILED :
+    mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED) {
+    error = "mmap failed";
+    return false;
+  }
+#endif
+  header = (const frame_bus_header *)ptr;
+  if (size < sizeof(frame_bus_header) ||
+    std::memcmp(header->magic, FRAME_BUS_MAGIC, sizeof(header->magic)) != 0)
+  {
+    close();
+    error = "not a frame bus (or not initialized yet)";
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header->version != FRAME_BUS_VERSION ||
+    size < sizeof(frame_bus_header) + header->slots*header->slot_bytes)
+  {
+    close();
+    error = "unsupported frame bus version";
+    return false;
+  }
+  // start with the frames published from now on
+  last_seq = header->published.load(std::memory_order_acquire);
+  dropped = 0;
+  return true;
+}
+
+void frame_bus_reader::close()
+{
+  if (!header)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(header);
+  CloseHandle((HANDLE)mapping_handle);
+  mapping_handle = nullptr;
+#else
+  munmap((void *)header, size);
+#endif
+  header = nullptr;
+}
+
+const frame_bus_slot *frame_bus_reader::slot(uint64_t seq) const
+{
+  return (const frame_bus_slot *)((const uint8_t *)header +
+    sizeof(frame_bus_header) + ((seq - 1) % header->slots)*header->slot_bytes);
+}
+
+bool frame_bus_reader::next(frame_bus_frame &f)
+{
+  const uint64_t published = header->published.load(std::memory_order_acquire);
+  while (last_seq < published) {
+    uint64_t seq = last_seq + 1;
+    if (published - seq >= header->slots) {
+      // lapped; the oldest frame still there is one slot ring ago
+      seq = published - header->slots + 1;
+      dropped += seq - (last_seq + 1);
+    }
+    const frame_bus_slot *s = slot(seq);
+    const uint64_t lock = s->lock.load(std::memory_order_acquire);
+    if (lock < 2*seq)
+      return false; // not finished yet
+    if (lock == 2*seq) {
+      f.metadata = s->metadata;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (s->lock.load(std::memory_order_relaxed) == lock) {
+        f.seq = seq;
+        f.pixels = (const uint8_t *)(s + 1);
+        f.width = (int)header->width;
+        f.height = (int)header->height;
+        f.stride = header->stride;
+        last_seq = seq;
+        return true;
+      }
+    }
+    // overwritten while we looked
+    dropped++;
+    last_seq = seq;
+  }
+  return false;
+}
+
+bool frame_bus_reader::newest(frame_bus_frame &f)
+{
+  const uint64_t published = header->published.load(std::memory_order_acquire);
+  if (published > last_seq + 1) {
+    dropped += published - 1 - last_seq;
+    last_seq = published - 1;
+  }
+  return next(f);
+}
+
+bool frame_bus_reader::still_valid(const frame_bus_frame &f) const
+{
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot(f.seq)->lock.load(std::memory_order_relaxed) == 2*f.seq;
+}
@@ -0,0 +1,141 @@
+#ifndef FRAMEBUS_HPP
+#define FRAMEBUS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The frame bus (--frame-bus=NAME) exposes mdet's capture ring to other
+// local processes as a named shared memory object (shm_open on POSIX, a
+// named file mapping on Windows).  The capture ring's images live in the
+// shared memory, so the camera decodes straight into it and readers use the
+// pixels in place; nothing is copied on either side.
+//
+//   frame_bus_header
+//   per slot (header.slots of them, each header.slot_bytes apart):
+//     frame_bus_slot   (metadata)
+//     uint8_t          pixels[height][stride] // BGR, 8 bits per channel
+//
+// Frame n (sequence numbers start at 1) lives in slot (n - 1) % slots.
+// Each slot is a seqlock: the writer stores 2n-1 in lock before touching
+// frame n and 2n once it's complete.  Readers never block the writer; a
+// reader that is too slow sees the lock move on and drops the frame.  Since
+// pixels are read in place, a reader calls frame_bus_reader::still_valid
+// after it's done with a frame to learn if it was overwritten meanwhile.
+//
+// This header doesn't need OpenCV so other programs can use it alone.
+
+static const char FRAME_BUS_MAGIC[8] = {'M','D','F','B','U','S','\0','\0'};
+static const uint32_t FRAME_BUS_VERSION = 1;
+// zone scores are reserved for per-zone detection; mdet has no zones yet,
+// so zone_count is always 0 for now
+static const int FRAME_BUS_MAX_ZONES = 8;
+
+static const uint32_t FRAME_BUS_TRIGGERED   = 0x1; // this frame triggered
+static const uint32_t FRAME_BUS_RECORDING   = 0x2; // written to a video
+static const uint32_t FRAME_BUS_CALIBRATING = 0x4; // no threshold yet
+static const uint32_t FRAME_BUS_UNSCORED    = 0x8; // motion_score is stale
+static const uint32_t FRAME_BUS_BOUNDED     = 0x10; // motion_score is a bound
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+  "the frame bus needs address-free 64-bit atomics");
+
+struct alignas(64) frame_bus_header {
+  char                  magic[8];
+  uint32_t              version;
+  uint32_t              slots;
+  uint32_t              width, height;
+  uint32_t              stride;     // bytes per pixel row
+  uint32_t              producer_pid;
+  uint64_t              slot_bytes; // distance between slots
+  std::atomic<uint64_t> published;  // newest complete frame (0 if none)
+  std::atomic<int64_t>  heartbeat_us; // time_us of the newest frame
+};
+
+struct frame_bus_metadata {
+  int64_t  time_us;      // capture time (microseconds since the epoch)
+  float    motion_score; // the last score if FRAME_BUS_UNSCORED
+  float    threshold;
+  uint32_t flags;        // FRAME_BUS_*
+  uint32_t zone_count;
+  float    zone_scores[FRAME_BUS_MAX_ZONES];
+};
+
+// the pixels follow this (so rows start 64-byte aligned)
+struct alignas(64) frame_bus_slot {
+  std::atomic<uint64_t> lock; // 2n-1 while frame n is written; 2n after
+  frame_bus_metadata    metadata;
+};
+
+// the producer side (mdet)
+struct frame_bus_writer {
+  frame_bus_header *header = nullptr;
+
+  frame_bus_writer() { }
+  frame_bus_writer(const frame_bus_writer &) = delete;
+  frame_bus_writer &operator=(const frame_bus_writer &) = delete;
+  ~frame_bus_writer() {close();}
+
+  bool open(const std::string &name,
+    int width, int height, int slots, std::string &error);
+  bool is_open() const {return header != nullptr;}
+  void close();
+
+  uint8_t *pixels(int slot) const;
+  size_t stride() const {return header->stride;}
+
+  // before the pixels of frame seq are written (to slot (seq - 1) % slots)
+  void begin(uint64_t seq);
+  // after; readers can see the frame once this returns
+  void publish(uint64_t seq, const frame_bus_metadata &md);
+
+private:
+  std::string name;
+  size_t      size = 0;
+#ifdef _WIN32
+  void       *mapping_handle = nullptr;
+#endif
+};
+
+// a frame being read; pixels point into the shared memory
+struct frame_bus_frame {
+  uint64_t           seq = 0;
+  frame_bus_metadata metadata;
+  const uint8_t     *pixels = nullptr;
+  int                width = 0, height = 0;
+  size_t             stride = 0;
+};
+
+// the consumer side
+struct frame_bus_reader {
+  const frame_bus_header *header = nullptr;
+  uint64_t                last_seq = 0; // the last frame returned
+  uint64_t                dropped = 0;  // frames overwritten before we got them
+
+  frame_bus_reader() { }
+  frame_bus_reader(const frame_bus_reader &) = delete;
+  frame_bus_reader &operator=(const frame_bus_reader &) = delete;
+  ~frame_bus_reader() {close();}
+
+  bool open(const std::string &name, std::string &error);
+  bool is_open() const {return header != nullptr;}
+  void close();
+
+  // the oldest frame after last_seq still in the ring; false if there is
+  // nothing new (this never waits)
+  bool next(frame_bus_frame &f);
+  // skips to the newest frame
+  bool newest(frame_bus_frame &f);
+  // true if f's pixels weren't overwritten (call after using them)
+  bool still_valid(const frame_bus_frame &f) const;
+
+private:
+  const frame_bus_slot *slot(uint64_t seq) const;
+  size_t      size = 0;
+#ifdef _WIN32
+  void       *mapping_handle = nullptr;
+#endif
+};
+
+#endif
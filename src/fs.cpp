@@ -12,6 +12,8 @@ namespace sfs = std::experimental::filesystem;
 #else
 #error "cannot find a std::filesystem header"
 #endif
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 
 // combines dir and file into platform specific dir/file
@@ -61,6 +63,29 @@ void fs::create_directory_if_absent(
   }
 }
 
+void fs::rename_overwrite(
+  const path &source_file,
+  const path &target_file,
+  std::string &error_message)
+{
+  try {
+    sfs::rename(source_file, target_file);
+  } catch(sfs::filesystem_error &fse) {
+    error_message = fse.what();
+  } catch(...) {
+    error_message = "rename failed (unknown error)";
+  }
+}
+
+int64_t fs::last_write_time(const fs::path &p) {
+  try {
+    return (int64_t)sfs::last_write_time(sfs::path(p))
+      .time_since_epoch().count();
+  } catch (...) {
+    return -1;
+  }
+}
+
 bool fs::is_absolute_path(const fs::path &p) {
   return sfs::path(p).is_absolute();
 }
@@ -69,6 +94,58 @@ bool fs::directory_exists(const fs::path &p) {
   return sfs::is_directory(sfs::path(p));
 }
 
+bool fs::file_exists(const fs::path &p) {
+  return sfs::is_regular_file(sfs::path(p));
+}
+
+std::vector<fs::path> fs::list_directory(const fs::path &dir) {
+  std::vector<fs::path> files;
+  try {
+    for (const auto &e : sfs::directory_iterator(sfs::path(dir))) {
+      if (sfs::is_regular_file(e.status()))
+        files.push_back(e.path().string());
+    }
+  } catch (...) {
+    files.clear();
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+int64_t fs::file_size(const fs::path &p) {
+  try {
+    return (int64_t)sfs::file_size(sfs::path(p));
+  } catch (...) {
+    return -1;
+  }
+}
+
+int64_t fs::file_age_seconds(const fs::path &p) {
+  try {
+    auto t = sfs::last_write_time(sfs::path(p));
+    return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+      decltype(t)::clock::now() - t).count();
+  } catch (...) {
+    return -1;
+  }
+}
+
+int64_t fs::available_space(const fs::path &p) {
+  try {
+    return (int64_t)sfs::space(sfs::path(p.empty() ? "." : p)).available;
+  } catch (...) {
+    return -1;
+  }
+}
+
+void fs::resize_file(const fs::path &p, uint64_t size, std::string &error) {
+  try {
+    sfs::resize_file(sfs::path(p), (uintmax_t)size);
+  } catch (const std::exception &e) {
+    error = e.what();
+  }
+}
+
 void fs::remove_if_exists(const fs::path &p) {
   if (sfs::is_regular_file(sfs::path(p))) {
     try {
@@ -78,3 +155,103 @@ void fs::remove_if_exists(const fs::path &p) {
     }
   }
 }
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+
+bool fs::mapped_file::open(const fs::path &p, std::string &error)
+{
+  close();
+  HANDLE fh = CreateFileA(p.c_str(), GENERIC_READ,
+    FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (fh == INVALID_HANDLE_VALUE) {
+    error = "failed to open file";
+    return false;
+  }
+  LARGE_INTEGER sz;
+  if (!GetFileSizeEx(fh, &sz)) {
+    CloseHandle(fh);
+    error = "failed to stat file";
+    return false;
+  }
+  file_handle = fh;
+  if (sz.QuadPart == 0) {
+    return true;
+  }
+  HANDLE mh = CreateFileMappingA(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mh == nullptr) {
+    close();
+    error = "CreateFileMapping failed";
+    return false;
+  }
+  mapping_handle = mh;
+  data = (const uint8_t *)MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+  if (data == nullptr) {
+    close();
+    error = "MapViewOfFile failed";
+    return false;
+  }
+  size = (size_t)sz.QuadPart;
+  return true;
+}
+
+void fs::mapped_file::close()
+{
+  if (data)
+    UnmapViewOfFile(data);
+  if (mapping_handle)
+    CloseHandle((HANDLE)mapping_handle);
+  if (file_handle)
+    CloseHandle((HANDLE)file_handle);
+  data = nullptr;
+  size = 0;
+  mapping_handle = file_handle = nullptr;
+}
+
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool fs::mapped_file::open(const fs::path &p, std::string &error)
+{
+  close();
+  int fd = ::open(p.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = "failed to open file";
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    error = "failed to stat file";
+    return false;
+  }
+  if (st.st_size == 0) {
+    ::close(fd);
+    return true;
+  }
+  // the mapping keeps its own reference to the file
+  void *ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED) {
+    error = "mmap failed";
+    return false;
+  }
+  data = (const uint8_t *)ptr;
+  size = (size_t)st.st_size;
+  return true;
+}
+
+void fs::mapped_file::close()
+{
+  if (data)
+    munmap((void *)data, size);
+  data = nullptr;
+  size = 0;
+}
+#endif
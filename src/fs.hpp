@@ -1,7 +1,10 @@
 #ifndef FS_HPP
 #define FS_HPP
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace fs {
   // Wrapper to std::filesystem since it's still a little skitzo on some
@@ -34,11 +37,61 @@ namespace fs {
   // std::filesystem::path::is_absolute
   bool is_absolute_path(const path &p);
 
+  // std::filesystem::last_write_time as a tick count; -1 if it's missing
+  int64_t last_write_time(const path &p);
+
   // std::filesystem::path::is_absolute
   bool directory_exists(const path &p);
 
+  // std::filesystem::is_regular_file
+  bool file_exists(const path &p);
+
+  // the regular files directly in dir (sorted by name); empty on error
+  std::vector<path> list_directory(const path &dir);
+
+  // std::filesystem::file_size; -1 if it's missing
+  int64_t file_size(const path &p);
+
+  // seconds since the file was last written; -1 if it's missing
+  int64_t file_age_seconds(const path &p);
+
+  // std::filesystem::space (available to us) for the volume holding p;
+  // -1 on error
+  int64_t available_space(const path &p);
+
+  // std::filesystem::resize_file (e.g. to cut off a torn tail)
+  void resize_file(const path &p, uint64_t size, std::string &error);
+
   // removes a file if already exists (e.g. so we get a fresh create stamp)
   void remove_if_exists(const path &p);
+
+  // std::filesystem::rename; replaces target (so a file written to a
+  // temporary name can be swapped in whole)
+  void rename_overwrite(
+    const path &source_file,
+    const path &target_file,
+    std::string &error_message);
+
+  // A read-only memory mapping of an entire file (mmap or MapViewOfFile).
+  // An empty file opens successfully, but maps to nullptr with size 0.
+  struct mapped_file {
+    const uint8_t *data = nullptr;
+    size_t         size = 0;
+
+    mapped_file() { }
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    ~mapped_file() {close();}
+
+    bool open(const path &p, std::string &error);
+    void close();
+
+  private:
+#ifdef _WIN32
+    void *file_handle = nullptr;
+    void *mapping_handle = nullptr;
+#endif
+  };
 } // fs::
 
 #endif
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "mdet.hpp"
+
+bool budget_governor::set_ladder(
+  const std::vector<std::string> &names, std::string &error)
+{
+  ladder.clear();
+  level = 0;
+  for (const std::string &n : names) {
+    int s = 0;
+    while (s < GOVERNOR_STEPS && n != GOVERNOR_STEP_NAMES[s])
+      s++;
+    if (s == GOVERNOR_STEPS) {
+      error = n + ": unknown governor step";
+      return false;
+    }
+    ladder.push_back((governor_step)s);
+  }
+  savings.assign(ladder.size(), 1.0);
+  restore_s.assign(ladder.size(), GOVERNOR_RESTORE_S);
+  return true;
+}
+
+bool budget_governor::active(governor_step s) const {
+  for (int i = 0; i < level; i++)
+    if (ladder[i] == s)
+      return true;
+  return false;
+}
+
+int budget_governor::add_frame(
+  int64_t frame_busy_us, double budget_ms, bool frame_late)
+{
+  if (frames == 0)
+    window_start = now();
+  frames++;
+  busy_us += frame_busy_us;
+  budget_us += (int64_t)(budget_ms*1000.0);
+  late += frame_late ? 1 : 0;
+  if (now() - window_start < std::chrono::seconds(1))
+    return 0;
+
+  utilization = budget_us > 0 ? (double)busy_us/budget_us : 0.0;
+  const bool overloaded = utilization > GOVERNOR_HIGH ||
+    late > GOVERNOR_LATE_FRACTION*frames;
+  const bool idle = utilization < GOVERNOR_LOW && late == 0;
+  overloaded_windows = overloaded ? overloaded_windows + 1 : 0;
+  idle_windows = idle ? idle_windows + 1 : 0;
+  frames = late = 0;
+  busy_us = budget_us = 0;
+  if (measure_saving && level > 0) {
+    measure_saving = false;
+    if (utilization_before > 0.0)
+      savings[level - 1] =
+        std::max(0.1, std::min(1.0, utilization/utilization_before));
+  }
+
+  if (overloaded_windows >= GOVERNOR_DEGRADE_WINDOWS &&
+    level < (int)ladder.size())
+  {
+    if (restored_step == level &&
+      now() - restored_at < std::chrono::seconds(GOVERNOR_RELAPSE_S))
+    {
+      restore_s[level] = std::min(2*restore_s[level], GOVERNOR_MAX_RESTORE_S);
+    }
+    overloaded_windows = 0;
+    utilization_before = utilization;
+    measure_saving = true;
+    level++;
+    transitions++;
+    return 1;
+  } else if (level > 0 && idle_windows >= restore_s[level - 1] &&
+    utilization/savings[level - 1] < GOVERNOR_HIGH)
+  {
+    idle_windows = 0;
+    level--;
+    restored_step = level;
+    restored_at = now();
+    transitions++;
+    return -1;
+  }
+  return 0;
+}
+
+void motion_detector::update_governor(int64_t frame_busy_us, bool frame_late)
+{
+  const uint64_t window_late = governor.late + (frame_late ? 1 : 0);
+  int step = governor.add_frame(frame_busy_us, scheduler.budget_ms(),
+    frame_late);
+  if (step == 0)
+    return;
+  const governor_step s =
+    governor.ladder[step > 0 ? governor.level - 1 : governor.level];
+  log("governor: ",format(100.0*governor.utilization,0,0),
+    "% of the frame budget (",window_late," late frames); ",
+    step > 0 ? "degrading: " : "restoring: ",GOVERNOR_STEP_NAMES[s],
+    " (level ",governor.level," of ",governor.ladder.size(),
+    step > 0 ? concat("; restores after ",
+      governor.restore_s[governor.level - 1]," s") : std::string(),")");
+  // the detection scale changes between frames (see sync_detect_scale)
+}
+
+void motion_detector::sync_detect_scale()
+{
+  const int scale =
+    governor.active(GOVERNOR_DOWNSCALE) ? GOVERNOR_DETECT_SCALE : 1;
+  if (scale == detect_scale)
+    return;
+  // the activity map is kept for full size frames
+  save_activity_map();
+  detect_scale = scale;
+  reset_background(0,"detection scale changed");
+  load_activity_map();
+}
+
+const image &motion_detector::detection_frame(const image &color_frame)
+{
+  if (detect_scale == 1)
+    return color_frame;
+  cv::resize(color_frame, detect_frame,
+    cv::Size(color_frame.cols/detect_scale, color_frame.rows/detect_scale),
+    0, 0, cv::INTER_AREA);
+  return detect_frame;
+}
+
+cv::Rect motion_detector::motion_box() const
+{
+  const cv::Rect b = motion_algorithm->motion_box();
+  return cv::Rect(b.x*detect_scale, b.y*detect_scale,
+    b.width*detect_scale, b.height*detect_scale);
+}
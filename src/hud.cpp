@@ -0,0 +1,216 @@
+#include "mdet.hpp"
+
+static const int GRAPH_HEIGHT = 200;
+static const int GRAPH_WIDTH = HUD_GRAPH_SAMPLES*HUD_GRAPH_DX;
+static const int BASE_X = 20, BASE_Y = 10;
+static const int TEXT_Y = BASE_Y + GRAPH_HEIGHT + 10;
+// colors are in BGR format
+static const cv::Scalar WHITE(255,255,255);
+static const cv::Scalar YELLOW(0,255,255);
+static const cv::Scalar RED(0,0,255);
+
+static void run_hud_thread(hud_thread *ht) {
+  ht->run();
+}
+
+hud_thread::hud_thread()
+  : stats_window(480,640,CV_8UC3,cv::Scalar::all(0))
+  , graph(GRAPH_HEIGHT,GRAPH_WIDTH,CV_8UC3,cv::Scalar::all(0))
+  , thread(run_hud_thread, this)
+{
+}
+
+hud_thread::~hud_thread() {
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    exit_hud = true;
+  }
+  snapshot_ready.notify_all();
+  thread.join();
+}
+
+void hud_thread::publish(hud_snapshot &s) {
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (has_pending) {
+      // the HUD is behind; keep the scores and any new background, but
+      // replace everything else
+      if (s.background.empty())
+        std::swap(s.background, pending.background);
+      pending.scores.insert(
+        pending.scores.end(), s.scores.begin(), s.scores.end());
+      s.scores.swap(pending.scores);
+    }
+    std::swap(pending, s);
+    has_pending = true;
+  }
+  s.scores.clear();
+  s.background.release();
+  snapshot_ready.notify_one();
+}
+
+int hud_thread::wait_key(int ms) {
+  return wait_key_until(now() + std::chrono::milliseconds(ms));
+}
+
+int hud_thread::wait_key_until(time_point deadline) {
+  std::unique_lock<std::mutex> lk(mutex);
+  key_ready.wait_until(lk, deadline, [&] {return !keys.empty();});
+  if (keys.empty())
+    return -1;
+  int key = keys.front();
+  keys.pop_front();
+  return key;
+}
+
+void hud_thread::run() {
+  enter_thread_role(THREAD_HUD);
+  hud_snapshot s;
+  while (true) {
+    bool have_snapshot = false;
+    {
+      std::unique_lock<std::mutex> lk(mutex);
+      snapshot_ready.wait_for(lk,
+        std::chrono::milliseconds(1000/HUD_REFRESH_HZ),
+        [&] {return has_pending || exit_hud;});
+      if (exit_hud)
+        break;
+      if (has_pending) {
+        std::swap(s, pending);
+        pending.scores.clear();
+        pending.background.release();
+        has_pending = false;
+        have_snapshot = true;
+      }
+    }
+    if (have_snapshot)
+      draw(s);
+
+    // pumps HighGUI's events too
+    int key = windows_open ? cv::waitKey(1) : -1;
+    if (key != -1) {
+      {
+        std::lock_guard<std::mutex> lk(mutex);
+        keys.push_back(key);
+      }
+      key_ready.notify_one();
+    }
+  }
+  if (windows_open)
+    cv::destroyAllWindows();
+}
+
+static int value_to_y(double value, double threshold) {
+  const double MAX = 1.5*threshold;
+  double t = threshold > 0.0 ? std::min(value,MAX)/MAX : 0.0;
+  return std::min(GRAPH_HEIGHT - 1,
+    std::max(0,(int)std::round((1.0 - t)*(GRAPH_HEIGHT - 1))));
+}
+
+static cv::Scalar color_for_value(double value, double threshold) {
+  double t = threshold > 0.0 ? std::min(1.0,value/threshold) : 1.0;
+  return cv::Scalar(
+    std::round((1.0-t*t)*255.0),
+    0,
+    std::round(t*t*255.0));
+}
+
+void hud_thread::draw_graph_column(uint64_t sample_index) {
+  // samples[sample_index] lands at a fixed position in the ring; so a new
+  // sample only clears and draws its own column
+  const double y = samples.elements[sample_index % HUD_GRAPH_SAMPLES];
+  const double prev_y = sample_index == 0 ? y :
+    samples.elements[(sample_index - 1) % HUD_GRAPH_SAMPLES];
+  const int x = (int)(sample_index % HUD_GRAPH_SAMPLES)*HUD_GRAPH_DX;
+
+  graph(cv::Rect(x,0,HUD_GRAPH_DX,GRAPH_HEIGHT)).setTo(cv::Scalar::all(0));
+  int threshold_y = value_to_y(graph_threshold, graph_threshold);
+  cv::line(graph,
+    cv::Point(x,threshold_y), cv::Point(x + HUD_GRAPH_DX - 1,threshold_y),
+    YELLOW);
+  cv::line(graph,
+    cv::Point(x,value_to_y(prev_y,graph_threshold)),
+    cv::Point(x + HUD_GRAPH_DX - 1,value_to_y(y,graph_threshold)),
+    color_for_value(y,graph_threshold));
+}
+
+void hud_thread::redraw_graph() {
+  graph.setTo(cv::Scalar::all(0));
+  uint64_t first =
+    samples.total > HUD_GRAPH_SAMPLES ? samples.total - HUD_GRAPH_SAMPLES : 0;
+  for (uint64_t i = first; i < samples.total; i++)
+    draw_graph_column(i);
+}
+
+void hud_thread::draw(const hud_snapshot &s) {
+  draw_cost.start();
+
+  // keep the graph current even when hidden so it's right when re-enabled
+  bool rescale = s.threshold != graph_threshold;
+  graph_threshold = s.threshold;
+  for (double score : s.scores) {
+    samples.add(score);
+    if (!rescale)
+      draw_graph_column(samples.total - 1);
+  }
+  if (rescale)
+    redraw_graph(); // the vertical scale follows the threshold
+
+  if (!s.enabled) {
+    if (windows_open) {
+      cv::destroyAllWindows();
+      windows_open = false;
+    }
+    draw_cost.stop();
+    return;
+  }
+
+  // unroll the ring so the oldest sample is on the left
+  int split =
+    (int)(samples.total % HUD_GRAPH_SAMPLES)*HUD_GRAPH_DX;
+  if (samples.total < HUD_GRAPH_SAMPLES)
+    split = 0;
+  image graph_area =
+    stats_window(cv::Rect(BASE_X,BASE_Y,GRAPH_WIDTH,GRAPH_HEIGHT));
+  graph(cv::Rect(split,0,GRAPH_WIDTH - split,GRAPH_HEIGHT)).copyTo(
+    graph_area(cv::Rect(0,0,GRAPH_WIDTH - split,GRAPH_HEIGHT)));
+  if (split > 0) {
+    graph(cv::Rect(0,0,split,GRAPH_HEIGHT)).copyTo(
+      graph_area(cv::Rect(GRAPH_WIDTH - split,0,split,GRAPH_HEIGHT)));
+  }
+  cv::rectangle(stats_window,
+    cv::Rect(BASE_X - 1,BASE_Y - 1,GRAPH_WIDTH + 2,GRAPH_HEIGHT + 2),
+    WHITE);
+
+  // text area under the graph
+  stats_window(cv::Rect(0,TEXT_Y,stats_window.cols,stats_window.rows - TEXT_Y))
+    .setTo(cv::Scalar::all(0));
+  if (samples.total > 0) {
+    auto last_motion = samples.newest();
+    cv::putText(stats_window, format(last_motion,0,3) + " / " +
+        format(s.threshold,0,3),
+      cv::Point(BASE_X,TEXT_Y + 20), cv::FONT_HERSHEY_PLAIN, 1.0,
+      last_motion > s.threshold ? RED : YELLOW);
+  }
+  if (s.video_offset != 0.0) {
+    std::stringstream voff;
+    voff << "recording (" << format(s.video_offset,0,1) << ")";
+    cv::putText(stats_window, voff.str(),
+      cv::Point(BASE_X,TEXT_Y + 60), cv::FONT_HERSHEY_PLAIN, 1.0, RED);
+  }
+  cv::putText(stats_window,
+    "draw " + format(draw_cost_ms,0,1) + " ms",
+    cv::Point(BASE_X,TEXT_Y + 100), cv::FONT_HERSHEY_PLAIN, 1.0, WHITE);
+
+  cv::imshow("stats",stats_window);
+  if (!s.frame.empty())
+    cv::imshow("current frame",s.frame);
+  if (!s.motion.empty())
+    cv::imshow("motion",s.motion);
+  if (!s.background.empty())
+    cv::imshow("background frame",s.background);
+  windows_open = true;
+
+  draw_cost.stop();
+  draw_cost_ms = draw_cost.average_ms();
+}
@@ -0,0 +1,167 @@
+#include "mdet.hpp"
+
+image illumination_luma(const image &color_frame)
+{
+  image gray, small;
+  cv::cvtColor(color_frame, gray, cv::COLOR_BGR2GRAY);
+  // area averaging doubles as the blur
+  cv::resize(gray, small,
+    cv::Size(std::max(1, gray.cols/ILLUMINATION_CELL),
+      std::max(1, gray.rows/ILLUMINATION_CELL)),
+    0.0, 0.0, cv::INTER_AREA);
+  return small;
+}
+
+illumination_fit fit_illumination(
+  const image &background_luma, const image &frame_luma)
+{
+  CV_Assert(background_luma.type() == CV_8UC1 &&
+    frame_luma.type() == CV_8UC1 &&
+    background_luma.size() == frame_luma.size());
+  illumination_fit f;
+  const int cells = (int)background_luma.total();
+  if (cells == 0)
+    return f;
+  auto usable = [] (int v) {
+    return v >= ILLUMINATION_MIN_LEVEL && v <= ILLUMINATION_MAX_LEVEL;
+  };
+  std::vector<uint8_t> fitted(cells, 0);
+  int n_usable = 0, n_changed = 0;
+  for (int y = 0, i = 0; y < frame_luma.rows; y++) {
+    const uint8_t *b = background_luma.ptr<uint8_t>(y);
+    const uint8_t *c = frame_luma.ptr<uint8_t>(y);
+    for (int x = 0; x < frame_luma.cols; x++, i++) {
+      if (std::abs((int)c[x] - (int)b[x]) > ILLUMINATION_CELL_DIFF)
+        n_changed++;
+      if (usable(b[x]) && usable(c[x])) {
+        fitted[i] = 1;
+        n_usable++;
+      }
+    }
+  }
+  f.changed = (double)n_changed/cells;
+  // mostly saturated (or black) says nothing either way
+  if (n_usable < cells/2 || f.changed < ILLUMINATION_MIN_CHANGED)
+    return f;
+
+  auto fit = [&] () {
+    double sb = 0.0, sc = 0.0, sbb = 0.0, sbc = 0.0;
+    int n = 0;
+    for (int y = 0, i = 0; y < frame_luma.rows; y++) {
+      const uint8_t *b = background_luma.ptr<uint8_t>(y);
+      const uint8_t *c = frame_luma.ptr<uint8_t>(y);
+      for (int x = 0; x < frame_luma.cols; x++, i++) {
+        if (!fitted[i])
+          continue;
+        sb += b[x];
+        sc += c[x];
+        sbb += (double)b[x]*b[x];
+        sbc += (double)b[x]*c[x];
+        n++;
+      }
+    }
+    if (n == 0)
+      return false;
+    const double var = sbb - sb*sb/n;
+    // a flat scene only shows the offset
+    f.gain = var > n ? (sbc - sb*sc/n)/var : 1.0;
+    f.offset = (sc - f.gain*sb)/n;
+    return true;
+  };
+  std::vector<uint8_t> missed(cells, 0); // cells the fit doesn't explain
+  auto residual = [&] (bool refit) {
+    int n_residual = 0;
+    for (int y = 0, i = 0; y < frame_luma.rows; y++) {
+      const uint8_t *b = background_luma.ptr<uint8_t>(y);
+      const uint8_t *c = frame_luma.ptr<uint8_t>(y);
+      for (int x = 0; x < frame_luma.cols; x++, i++) {
+        const double predicted = f.gain*b[x] + f.offset;
+        // predictions past the ends clip like the camera would
+        const double d =
+          c[x] - std::min(255.0, std::max(0.0, predicted));
+        missed[i] = std::abs(d) > ILLUMINATION_CELL_DIFF;
+        if (missed[i]) {
+          n_residual++;
+          if (refit)
+            fitted[i] = 0;
+        }
+      }
+    }
+    return (double)n_residual/cells;
+  };
+  if (!fit())
+    return f;
+  // motion in the frame pulls the first fit; so fit again without it
+  residual(true);
+  if (!fit())
+    return f;
+  f.residual = residual(false);
+  if (f.residual > ILLUMINATION_MAX_RESIDUAL)
+    return f;
+
+  // what's left should be scattered (highlights, shadow edges); a compact
+  // cluster is something that came in with the light
+  const int cols = frame_luma.cols, rows = frame_luma.rows;
+  std::vector<int> stack;
+  for (int start = 0; start < cells; start++) {
+    if (!missed[start])
+      continue;
+    int size = 0;
+    missed[start] = 0;
+    stack.push_back(start);
+    while (!stack.empty()) {
+      const int i = stack.back();
+      stack.pop_back();
+      size++;
+      const int x = i % cols, y = i / cols;
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          const int nx = x + dx, ny = y + dy;
+          if (nx < 0 || ny < 0 || nx >= cols || ny >= rows)
+            continue;
+          if (missed[ny*cols + nx]) {
+            missed[ny*cols + nx] = 0;
+            stack.push_back(ny*cols + nx);
+          }
+        }
+      }
+    }
+    f.largest_cluster = std::max(f.largest_cluster, size);
+  }
+  f.lighting = f.largest_cluster < ILLUMINATION_MAX_CLUSTER;
+  return f;
+}
+
+bool motion_detector::rejected_as_lighting(double score)
+{
+  if (os.record_lighting_changes || background_luma.empty())
+    return false;
+  const image &frame = color_frames.newest();
+  const image luma = illumination_luma(frame);
+  if (luma.size() != background_luma.size())
+    return false;
+  const illumination_fit f = fit_illumination(background_luma, luma);
+  auto describe = [&] {
+    return concat(format(score,0,3)," > ",
+      format(motion_threshold,0,3),"; gain ",format(f.gain,0,2),
+      ", offset ",format(f.offset,0,1),"; ",format(100.0*f.changed,0,1),
+      "% of the scene changed, ",format(100.0*f.residual,0,1),
+      "% after the fit, largest cluster ",f.largest_cluster," cells");
+  };
+  if (!f.lighting)
+    return false;
+  if (lighting_adopted) {
+    // still settling; this was fitted against last frame's background
+    if (uptime() - lighting_since >= ILLUMINATION_SETTLE_S) {
+      log("lighting still changing after ",format(ILLUMINATION_SETTLE_S,0,1),
+        " s (",describe(),"); treating it as motion");
+      return false;
+    }
+  } else {
+    lighting_changes++;
+    lighting_since = uptime();
+    log("lighting change (",describe(),"); not recording");
+  }
+  adopt_background(frame);
+  return true;
+}
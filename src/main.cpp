@@ -1,5 +1,9 @@
 #include "mdet.hpp"
+#include "batch.hpp"
+#include "events.hpp"
 #include "fs.hpp"
+#include "scorelog.hpp"
+#include "sweep.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -24,7 +28,47 @@ int main(int argc, char **argv)
     "where\n"
     "  OPTIONS are:\n"
     //||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||v 80 cols
+    "    --activity-map=PATH         where the learned activity heatmap (noisy blocks\n"
+    "                                are masked; static ones sampled less) is kept\n"
+    "                                across runs (defaults to mdet-activity-N.map\n"
+    "                                for --camera=N)\n"
+    "                                an empty PATH learns from scratch every run\n"
+    "    --adaptive-recording        keep scoring while recording: quiet stretches\n"
+    "                                repeat every " << ADAPTIVE_QUIET_DIVISOR << "th frame (a lower effective\n"
+    "                                frame rate) and the writer quality follows\n"
+    "                                the score (where the codec supports it)\n"
+    "    --calibration-mads=FLT      sensitivity of the online threshold calibration\n"
+    "                                as median + FLT x MAD of quiet frame scores\n"
+    "                                (defaults to " << format(os.calibration_mad_units,0,1) << "; lower is more sensitive)\n"
+    "    --camera=INT                the camera device index to open\n"
+    "                                (defaults to " << os.camera << ")\n"
+    "    --config=PATH               a file of \"key = value\" lines for the options\n"
+    "                                calibration-mads, detector, fps,\n"
+    "                                max-video-length, max-videos,\n"
+    "                                motion-mask-scale, motion-threshold (or\n"
+    "                                \"auto\") and remote-copy; it overrides the\n"
+    "                                command line and is reloaded (between frames)\n"
+    "                                whenever it changes or on SIGHUP\n"
+    "    --detector=NAME             the motion detection algorithm: blur-absdiff,\n"
+    "                                running-average, mog2, knn or block-hash\n"
+    "                                (defaults to " << DEFAULT_DETECTOR << "); scores and\n"
+    "                                thresholds differ between detectors\n"
+    "    --event-index=PATH          the binary event index to append motion\n"
+    "                                events to (defaults to " << os.event_index_path << ")\n"
+    "                                this file is not rotated by --log-rotate\n"
     "    --exit-after=INT            exits after this many seconds\n"
+    "    --fps=FLT                   the frame rate to pace capture and detection\n"
+    "                                at; also the rate written into videos\n"
+    "                                (defaults to " << TARGET_FPS << ")\n"
+    "    --frame-bus=NAME            publish captured frames (with their scores) in\n"
+    "                                shared memory under NAME for local readers\n"
+    "                                (see examples/framebus_reader.cpp)\n"
+    "    --governor=STEP,...         what to give up, in order, when frames overrun\n"
+    "                                their budget: hud (refresh less often),\n"
+    "                                downscale (detection), skip-detect (score\n"
+    "                                every other frame), encoder-fps (record half\n"
+    "                                the frames new); restored when load drops\n"
+    "                                (defaults to off; e.g. give all four)\n"
     "    --headless                  don't open any windows to show statistics\n"
     "    --log-file=PATH             specifies the log file path\n"
     "                                (defaults to " << os.log_file_path << ")\n"
@@ -34,28 +78,123 @@ int main(int argc, char **argv)
     "                                output; this also impacts --remote-copy\n"
     "                                NOTE: a successive run will not pre-delete old\n"
     "                                motion videos, so check the file timestamps\n"
+    "                                (the --storage-* budgets cover every day's\n"
+    "                                directory)\n"
     "    --max-videos=INT            exit after creating this many videos\n"
     "                                (defaults to " << os.max_videos << ")\n"
     "    --max-video-length=INT      maximum length in seconds for video captures\n"
     "                                (defaults to " << os.max_video_length << ")\n"
     "                                setting this to 0 disables video capture\n"
+    "    --motion-mask-scale=INT     downsample factor for the motion mask file\n"
+    "                                (motion#####.mask) written beside each video\n"
+    "                                (defaults to " << os.motion_mask_scale << "); 0 disables it\n"
     "    --motion-threshold=FLT      sets the motion threshold to a given value\n"
     "                                this must be value between 0.0 and 255.0;\n"
     "                                good values are around 0.5 to 2.0; the program\n"
     "                                compares this to the average pixel value\n"
     "                                (0 to 255) in the blurred difference image\n"
     "                                to infer motion; by default the program\n"
-    "                                automatically calibrates the threshold upon\n"
-    "                                startup\n"
+    "                                continuously calibrates the threshold from\n"
+    "                                recent quiet frames (see --calibration-mads)\n"
+    "    --perf-counters             measure each pipeline stage with hardware\n"
+    "                                counters (cycles, instructions, cache misses;\n"
+    "                                Linux only) and context switches; 'd' and\n"
+    "                                shutdown print them\n"
     "    --preferred-fourcc=CHAR[4]  the four character code for the video format\n"
     "                                (passed to cv::VideoWriter); without this set\n"
     "                                (or if this code fails)  the program tries\n"
     "                                several possible formats (e.g. H264, X264,\n"
     "                                XVID, MP4V etc...); for an h264 encoder see\n"
     "                                https://github.com/cisco/openh264/releases\n"
+    "    --record-lighting-changes   record lighting changes as motion; by default\n"
+    "                                a trigger that a global gain and offset\n"
+    "                                explain only refreshes the background\n"
     "    --remote-copy=PATH          asynchronously copy videos to this directory\n"
+    "    --roi-stream                also write a full resolution crop that follows\n"
+    "                                the motion (motion#####-roi.mp4); implies\n"
+    "                                --adaptive-recording\n"
+    "    --score-log=PATH            append every frame's motion score to this\n"
+    "                                binary log (for use with --replay)\n"
     "    --startup-delay=INT         delay this many seconds before starting up\n"
-    "                                (defaults to " << os.startup_delay << ")\n" <<
+    "                                (defaults to " << os.startup_delay << ")\n"
+    "    --storage-max=BYTES         prune the oldest clips (videos, masks and ROI\n"
+    "                                streams) when they total more than this\n"
+    "                                (e.g. 500M or 20G); new clips then number on\n"
+    "                                from the newest one; STEM.keep pins a clip\n"
+    "    --storage-max-age=DAYS      prune clips older than this\n"
+    "    --storage-min-free=BYTES    prune the oldest clips while the volume has\n"
+    "                                less than this free\n"
+    "    --thread-cpus=ROLE:LIST     pins a thread role to these cpus (e.g. 0,2-3)\n"
+    "                                ROLE is capture (which also detects and\n"
+    "                                encodes), hud, copy, writer, config,\n"
+    "                                storage or thumbnail;\n"
+    "                                by default nothing is pinned (a pinned\n"
+    "                                capture thread also pins the OpenCV and\n"
+    "                                encoder threads it starts)\n"
+    "    --thread-nice=ROLE:INT      the role's nice value (defaults: capture -5,\n"
+    "                                hud and writer 5, the others 10)\n"
+    "    --thread-policy=ROLE:POLICY[:PRIO]\n"
+    "                                other, batch, idle, fifo or rr (with a\n"
+    "                                priority); copy, storage and thumbnail\n"
+    "                                default to batch\n"
+    "    --thread-topology=MODE      default or none (only the --thread-* given)\n"
+    "    --thumbnails                write JPEGs of each clip's trigger, peak and\n"
+    "                                last frames and a contact sheet of them\n"
+    "                                (motion#####-*.jpg); with --remote-copy they\n"
+    "                                are copied ahead of the videos\n"
+    "    --warm-start=PATH           snapshot the threshold calibration and\n"
+    "                                background here; a snapshot that still\n"
+    "                                matches the scene skips the calibration\n"
+    "                                (detector models such as running-average,\n"
+    "                                mog2 and knn still start from scratch)\n"
+    "                                (defaults to mdet-warm-N.state for\n"
+    "                                --camera=N; empty disables)\n"
+    "  QUERY MODE (searches the event index and exits)\n"
+    "    --query                     enables query mode\n"
+    "    --from=TIME                 earliest event time (inclusive)\n"
+    "    --to=TIME                   latest event time (exclusive)\n"
+    "                                TIME is local time as YYYY-MM-DD[ HH:MM[:SS]]\n"
+    "                                or an integer number of seconds since the epoch\n"
+    "    --min-score=FLT             omit events with a lower peak score\n"
+    "    --camera=INT                only report events from this camera\n"
+    "  REPLAY MODE (re-runs the trigger policy over a --score-log and exits)\n"
+    "    --replay=PATH               the score log to replay\n"
+    "    --motion-threshold=FLT      a fixed threshold to evaluate; without this\n"
+    "                                we calibrate online (--calibration-mads)\n"
+    "    --replay-hysteresis=FLT     after a trigger re-arm only once the score\n"
+    "                                falls below this fraction of the threshold\n"
+    "                                (defaults to 0.0, which re-arms immediately)\n"
+    "    --replay-holdoff=FLT        seconds ignored after each trigger\n"
+    "                                (defaults to --max-video-length)\n"
+    "    --replay-min-frames=INT     consecutive frames over the threshold\n"
+    "                                needed to trigger (defaults to 1)\n"
+    "    --replay-list               list each trigger\n"
+    "  SWEEP MODE (evaluates a grid of detector settings over a video and exits)\n"
+    "    --sweep=PATH                the recorded video to evaluate\n"
+    "    --sweep-blur=INT,...        blur kernel sizes (odd; defaults to 21)\n"
+    "    --sweep-scale=INT,...       detection downscale factors (defaults to 1)\n"
+    "    --sweep-learning-rate=FLT,...\n"
+    "                                running average background learning rates;\n"
+    "                                0.0 means a static background that is reset\n"
+    "                                after each trigger (defaults to 0.0)\n"
+    "    --sweep-threshold=FLT,...   motion thresholds; 0.0 means calibrate online\n"
+    "                                (defaults to 0.0)\n"
+    "    --sweep-detector=NAME,...   also run these --detector algorithms (at each\n"
+    "                                threshold) and report their cost per frame\n"
+    "    --sweep-jobs=INT            worker threads (defaults to the core count)\n"
+    "                                captures are assumed to last --max-video-length\n"
+    "  BATCH MODE (scans archived videos for motion on all cores and exits)\n"
+    "    --batch=PATH,...            videos, directories of videos or file name\n"
+    "                                patterns (e.g. cam2/*.mp4) to analyze with the\n"
+    "                                --detector, --motion-threshold (or online\n"
+    "                                calibration) and --max-video-length holdoff\n"
+    "    --batch-chunk=INT           seconds of video per work unit so long files\n"
+    "                                spread over the cores; 0 means whole files\n"
+    "                                (defaults to 1800)\n"
+    "    --batch-csv=PATH            writes each event (file, frame, offset, score)\n"
+    "    --batch-jobs=INT            worker threads (defaults to the core count)\n"
+    "    --batch-step=INT            a coarse pass scoring every INT'th frame\n"
+    "                                (events are then only good to INT frames)\n" <<
     "  INTERACTIVE OPTIONS (when focused on an OpenCV window)\n"
     "    type '?' to emit help to the console on which keys do what\n"
     //||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||^ 80 cols
@@ -64,6 +203,22 @@ int main(int argc, char **argv)
   // first check for  the --nightly option
   bool rotate_logs = false; // --log-rotate
 
+  bool query_mode = false; // --query
+  bool has_camera = false;
+  bool has_activity_map = false;
+  bool has_warm_start = false;
+  event_query eq;
+
+  bool has_replay_holdoff = false;
+  replay_options ro;
+
+  sweep_options so;
+
+  batch_options bo;
+
+  thread_topology thread_overrides; // --thread-*
+  bool thread_defaults = true;      // --thread-topology
+
   for (int i = 1; i < argc; i++) {
     std::string argstr(argv[i]);
     std::string opt_key;
@@ -110,6 +265,23 @@ int main(int argc, char **argv)
       }
       return value;
     };
+    auto optValList = [&](auto parse) {
+      needsOptValue();
+      std::vector<decltype(parse(std::string()))> values;
+      size_t off = 0;
+      while (off <= opt_value.size()) {
+        auto comma = opt_value.find(',', off);
+        if (comma == std::string::npos)
+          comma = opt_value.size();
+        try {
+          values.push_back(parse(opt_value.substr(off, comma - off)));
+        } catch (...) {
+          badOpt("malformed list element");
+        }
+        off = comma + 1;
+      }
+      return values;
+    };
     auto optValDouble = [&](){
       needsOptValue();
       double value = 0;
@@ -124,8 +296,66 @@ int main(int argc, char **argv)
     if (argstr == "-h" || argstr == "--help") {
       std::cout << USAGE.str();
       exit(EXIT_SUCCESS);
+    } else if (opt_key == "--adaptive-recording") {
+      forbidsOptValue();
+      os.adaptive_recording = true;
+    } else if (opt_key == "--batch") {
+      bo.inputs = optValList([](const std::string &s){return s;});
+    } else if (opt_key == "--batch-chunk") {
+      bo.chunk_s = (int)optValInt();
+      if (bo.chunk_s < 0)
+        badOpt("must be non-negative");
+    } else if (opt_key == "--batch-csv") {
+      bo.csv_path = optValStr();
+    } else if (opt_key == "--batch-jobs") {
+      bo.jobs = (int)optValInt();
+    } else if (opt_key == "--batch-step") {
+      bo.step = (int)optValInt();
+      if (bo.step <= 0)
+        badOpt("must be positive");
+    } else if (opt_key == "--calibration-mads") {
+      os.calibration_mad_units = optValDouble();
+      if (os.calibration_mad_units <= 0.0)
+        badOpt("must be positive");
+    } else if (opt_key == "--camera") {
+      os.camera = (int)optValInt();
+      has_camera = true;
+    } else if (opt_key == "--activity-map") {
+      os.activity_map_path = optValStr();
+      has_activity_map = true;
+    } else if (opt_key == "--config") {
+      os.config_path = optValStr();
+    } else if (opt_key == "--detector") {
+      os.detector = optValStr();
+      std::string error;
+      if (!create_detector(os.detector, error))
+        badOpt("unknown detector");
+    } else if (opt_key == "--event-index") {
+      os.event_index_path = optValStr();
+    } else if (opt_key == "--warm-start") {
+      os.warm_start_path = optValStr();
+      has_warm_start = true;
     } else if (opt_key == "--exit-after") {
       os.exit_after = (int)optValInt();
+    } else if (opt_key == "--from") {
+      if (!parse_event_time(optValStr(), eq.from_us))
+        badOpt("malformed time");
+    } else if (opt_key == "--fps") {
+      os.fps = optValDouble();
+      if (os.fps <= 0.0 || os.fps > 240.0)
+        badOpt("must be in (0,240]");
+    } else if (opt_key == "--frame-bus") {
+      os.frame_bus_name = optValStr();
+    } else if (opt_key == "--governor") {
+      if (opt_value == "off") {
+        os.governor_ladder.clear();
+      } else {
+        os.governor_ladder = optValList([](const std::string &s){return s;});
+        budget_governor bg;
+        std::string error;
+        if (!bg.set_ladder(os.governor_ladder, error))
+          badOpt(error.c_str());
+      }
     } else if (opt_key == "--headless") {
       forbidsOptValue();
       os.headless = true;
@@ -138,22 +368,156 @@ int main(int argc, char **argv)
       os.max_video_length = (int)optValInt();
     } else if (opt_key == "--max-videos") {
       os.max_videos = (int)optValInt();
+    } else if (opt_key == "--min-score") {
+      eq.min_score = optValDouble();
+    } else if (opt_key == "--motion-mask-scale") {
+      os.motion_mask_scale = (int)optValInt();
     } else if (opt_key == "--motion-threshold") {
       os.has_custom_motion_threshold = true;
       os.motion_threshold = optValDouble();
+    } else if (opt_key == "--perf-counters") {
+      forbidsOptValue();
+      os.perf_counters = true;
     } else if (opt_key == "--preferred-fourcc") {
       os.preferred_fourcc = optValStr();
       if (os.preferred_fourcc.size() != 4)
         badOpt("must be four characters");
+    } else if (opt_key == "--query") {
+      forbidsOptValue();
+      query_mode = true;
+    } else if (opt_key == "--record-lighting-changes") {
+      forbidsOptValue();
+      os.record_lighting_changes = true;
     } else if (opt_key == "--remote-copy") {
       os.remote_copy_dir = optValStr();
+    } else if (opt_key == "--replay") {
+      ro.path = optValStr();
+    } else if (opt_key == "--replay-hysteresis") {
+      ro.hysteresis = optValDouble();
+    } else if (opt_key == "--replay-holdoff") {
+      ro.holdoff_s = optValDouble();
+      has_replay_holdoff = true;
+    } else if (opt_key == "--replay-list") {
+      forbidsOptValue();
+      ro.list_triggers = true;
+    } else if (opt_key == "--replay-min-frames") {
+      ro.min_frames = (int)optValInt();
+    } else if (opt_key == "--roi-stream") {
+      forbidsOptValue();
+      os.adaptive_recording = os.roi_stream = true;
+    } else if (opt_key == "--score-log") {
+      os.score_log_path = optValStr();
     } else if (opt_key == "--startup-delay") {
       os.startup_delay = (int)optValInt();
+    } else if (opt_key == "--storage-max" ||
+      opt_key == "--storage-min-free")
+    {
+      int64_t bytes = 0;
+      if (!parse_byte_size(optValStr(), bytes))
+        badOpt("malformed size (e.g. 500M or 20G)");
+      (opt_key == "--storage-max" ?
+        os.storage_max_bytes : os.storage_min_free_bytes) = bytes;
+    } else if (opt_key == "--storage-max-age") {
+      os.storage_max_age_s = optValDouble()*24*60*60;
+      if (os.storage_max_age_s <= 0.0)
+        badOpt("must be positive");
+    } else if (opt_key == "--sweep") {
+      so.video_path = optValStr();
+    } else if (opt_key == "--sweep-blur") {
+      so.blur_sizes = optValList([](const std::string &s){return std::stoi(s);});
+    } else if (opt_key == "--sweep-detector") {
+      so.detectors = optValList([](const std::string &s){return s;});
+      for (const auto &d : so.detectors) {
+        std::string error;
+        if (!create_detector(d, error))
+          badOpt("unknown detector");
+      }
+    } else if (opt_key == "--sweep-jobs") {
+      so.jobs = (int)optValInt();
+    } else if (opt_key == "--sweep-learning-rate") {
+      so.learning_rates = optValList([](const std::string &s){return std::stod(s);});
+    } else if (opt_key == "--sweep-scale") {
+      so.scales = optValList([](const std::string &s){return std::stoi(s);});
+    } else if (opt_key == "--sweep-threshold") {
+      so.thresholds = optValList([](const std::string &s){return std::stod(s);});
+    } else if (opt_key == "--thumbnails") {
+      forbidsOptValue();
+      os.thumbnails = true;
+    } else if (opt_key == "--thread-cpus" || opt_key == "--thread-nice" ||
+      opt_key == "--thread-policy")
+    {
+      std::string error;
+      if (!parse_thread_setting(opt_key.substr(9), optValStr(),
+        thread_overrides, error))
+      {
+        badOpt(error.c_str());
+      }
+    } else if (opt_key == "--thread-topology") {
+      std::string mode = optValStr();
+      if (mode != "default" && mode != "none")
+        badOpt("expected default or none");
+      thread_defaults = mode == "default";
+    } else if (opt_key == "--to") {
+      if (!parse_event_time(optValStr(), eq.to_us))
+        badOpt("malformed time");
     } else {
       badOpt("unrecognized option");
     }
   }
 
+  if (query_mode) {
+    eq.path = os.event_index_path;
+    eq.camera = has_camera ? os.camera : -1;
+    return run_event_query(eq);
+  } else if (!ro.path.empty()) {
+    if (os.has_custom_motion_threshold)
+      ro.threshold = os.motion_threshold;
+    if (!has_replay_holdoff)
+      ro.holdoff_s = os.max_video_length;
+    ro.calibration_mad_units = os.calibration_mad_units;
+    return run_score_replay(ro);
+  } else if (!so.video_path.empty()) {
+    so.holdoff_s = os.max_video_length;
+    so.calibration_mad_units = os.calibration_mad_units;
+    return run_sweep(so);
+  } else if (!bo.inputs.empty()) {
+    bo.detector = os.detector;
+    if (os.has_custom_motion_threshold)
+      bo.threshold = os.motion_threshold;
+    bo.holdoff_s = os.max_video_length;
+    bo.calibration_mad_units = os.calibration_mad_units;
+    return run_batch(bo);
+  }
+
+  if (thread_defaults)
+    os.threads = default_thread_settings();
+  for (int r = 0; r < THREAD_ROLES; r++) {
+    const thread_settings &ts = thread_overrides[r];
+    if (!ts.cpus.empty())
+      os.threads[r].cpus = ts.cpus;
+    if (ts.has_nice) {
+      os.threads[r].has_nice = true;
+      os.threads[r].nice = ts.nice;
+    }
+    if (!ts.policy.empty()) {
+      os.threads[r].policy = ts.policy;
+      os.threads[r].priority = ts.priority;
+    }
+  }
+
+  if (!os.config_path.empty()) {
+    std::string error;
+    if (!read_config_file(os.config_path, os, error))
+      fatal(error);
+  }
+
+  // every camera learns its own map and snapshot (the files also record
+  // the camera)
+  if (!has_activity_map)
+    os.activity_map_path = concat("mdet-activity-",os.camera,".map");
+  if (!has_warm_start)
+    os.warm_start_path = concat("mdet-warm-",os.camera,".state");
+
   if (rotate_logs) {
     // --log-rotate=...
     // std::cout << "--log-rotate=... given\n";
@@ -213,6 +577,14 @@ void setup_rotating_logs(opts &os)
   if (!error.empty())
       fatal(error,": creating local video copy directory ",ss.str());
   os.motion_video_dir = ss.str();
+  os.log_rotate_dir = day_of_year;
+  // the other days' clips count against the storage budget too
+  for (int d = 0; d < ROTATING_LOG_MAX_DAYS; d++) {
+    std::stringstream dss;
+    dss << "logs" << std::setfill('0') << std::setw(5) << d;
+    if (dss.str() != ss.str() && fs::directory_exists(dss.str()))
+      os.storage_dirs.push_back(dss.str());
+  }
 
   if (!fs::is_absolute_path(os.log_file_path)) {
     os.log_file_path =
@@ -3,48 +3,149 @@
 
 #include <ctime>
 
+static std::string storage_budget(const opts &os) {
+  std::stringstream ss;
+  if (os.storage_max_bytes > 0)
+    ss << format_byte_size(os.storage_max_bytes) << " ";
+  if (os.storage_max_age_s > 0.0)
+    ss << format(os.storage_max_age_s/24/60/60,0,1) << " days ";
+  if (os.storage_min_free_bytes > 0)
+    ss << format_byte_size(os.storage_min_free_bytes) << " free ";
+  std::string s = ss.str();
+  return s.empty() ? "none" : s.substr(0, s.size() - 1);
+}
 
 motion_detector::motion_detector(
   std::ostream &_log_stream,
   const opts &_os)
   : os(_os)
-  , vc(0)
-  , log_stream(_log_stream)
-  , stats_window(480,640,CV_8UC3) {
+  , vc(_os.camera)
+  , log_stream(_log_stream) {
+  // before any other thread starts
+  set_thread_topology(os.threads);
+  enter_thread_role(THREAD_CAPTURE);
   if (!vc.isOpened()) {
     std::cerr << "FATAL: cannot open camera\n";
     std::exit(EXIT_FAILURE);
   }
+  // a hint; many cameras only support a few rates
+  vc.set(cv::CAP_PROP_FPS, os.fps);
+  std::string detector_error;
+  motion_algorithm = create_detector(os.detector, detector_error);
+  if (!motion_algorithm) {
+    std::cerr << "FATAL: " << detector_error << "\n";
+    std::exit(EXIT_FAILURE);
+  }
+  if (os.perf_counters) {
+    std::string error;
+    if (!perf.open(error))
+      log("perf counters: WARNING: ",error,
+        perf.counters.has_hardware() ? "" : " (measuring stage times only)");
+    motion_algorithm->perf = &perf;
+  }
+  std::string governor_error;
+  if (!governor.set_ladder(os.governor_ladder, governor_error))
+    fatal(governor_error);
+  if (!os.config_path.empty())
+    config.reset(new config_watcher(os));
+  storage.reset(new storage_manager(os));
+  // new clips go after the last one, so a restart can't overwrite the
+  // clips earlier event records name (and pruning leaves gaps at the front)
+  next_video_index = first_video_index = storage->next_index;
   hud_enabled = !os.headless;
+  if (!os.headless)
+    hud.reset(new hud_thread());
   vidcap_disabled = os.max_video_length <= 0;
   if (vidcap_disabled)
     log("video capture disabled (max video length <= 0)");
   motion_threshold = os.motion_threshold;
+  calibrator.mad_units = os.calibration_mad_units;
   startup_time = now();
+  if (!os.event_index_path.empty()) {
+    std::string error;
+    event_index.open(os.event_index_path, error);
+    if (!error.empty())
+      log(os.event_index_path,": WARNING: ",error," (events will not be indexed)");
+  }
+  if (!os.score_log_path.empty()) {
+    std::string error;
+    score_log.open(os.score_log_path, error);
+    if (!error.empty())
+      log(os.score_log_path,": WARNING: ",error," (scores will not be logged)");
+  }
   std::stringstream ss;
   ss <<
     "OPTIONS:\n" <<
-    "  motion_threshold:    " << format(motion_threshold,0,3) << "\n" <<
+    "  motion_threshold:    " << format(motion_threshold,0,3) <<
+      (os.has_custom_motion_threshold ? "" : " (calibrated online)") << "\n" <<
+    "  calibration MADs:    " << format(os.calibration_mad_units,0,2) << "\n" <<
     "  hud_enabled:         " << format(hud_enabled) << "\n" <<
     "  os.log_file_path:    " << os.log_file_path << "\n" <<
+    "  os.detector:         " << os.detector << "\n" <<
+    "  os.event_index_path: " << os.event_index_path << "\n" <<
+    "  os.activity_map_path:" << os.activity_map_path << "\n" <<
+    "  os.warm_start_path:  " << os.warm_start_path << "\n" <<
+    "  os.frame_bus_name:   " << os.frame_bus_name << "\n" <<
+    "  os.config_path:      " << os.config_path << "\n" <<
+    "  os.camera:           " << os.camera << "\n" <<
+    "  os.score_log_path:   " << os.score_log_path << "\n" <<
     "  os.motion_video_dir: " << os.motion_video_dir << "\n" <<
     "  os.remote_copy_dir:  " << os.remote_copy_dir << "\n" <<
     "  os.preferred_fourcc: " << os.preferred_fourcc << "\n" <<
-    "  os.max_videos:       " << os.max_videos << "\n" <<
+    "  os.max_videos:       " << os.max_videos <<
+      (first_video_index ? concat(" (from ",first_video_index,")") : "") <<
+      "\n" <<
+    "  storage budget:      " << storage_budget(os) << "\n" <<
     "  os.max_video_length: " << os.max_video_length << "\n" <<
+    "  os.motion_mask_scale:" << os.motion_mask_scale << "\n" <<
     "  os.startup_delay:    " << os.startup_delay << "\n" <<
+    "  os.fps:              " << format(os.fps,0,2) << "\n" <<
+    "  os.adaptive_recording:" << format(os.adaptive_recording) <<
+      (os.roi_stream ? " (with ROI stream)" : "") << "\n" <<
+    "  os.record_lighting_changes:" << format(os.record_lighting_changes) << "\n" <<
+    "  os.thumbnails:       " << format(os.thumbnails) << "\n" <<
     "  os.exit_after:       " << os.exit_after << "\n" <<
+    "  capture thread:      " << thread_role_status(THREAD_CAPTURE) << "\n" <<
+    "  governor steps:      " << os.governor_ladder.size() << "\n" <<
     "\n";
   log(ss.str());
+  log_storage_messages();
 }
 
 motion_detector::~motion_detector() {
   log("shutting down");
+  log("frames: ",scheduler.frames,
+    " (",scheduler.late_frames," late, ",
+    scheduler.skipped_frames," skipped)");
+  log("lighting changes: ",lighting_changes," (not recorded)");
+  log("wake-up jitter: ",format(scheduler.wake_latency_us.average()/1000.0,0,2),
+    " ms average (",format(scheduler.max_wake_latency_us/1000.0,0,2)," ms max)");
+  if (perf.enabled) {
+    std::stringstream ss;
+    perf.report(ss);
+    log("stage counters (averages per sample):\n",ss.str());
+  }
+  save_activity_map();
+  save_warm_start();
+  discard_warm_writer();
+  for (thumbnail_job *tj : thumbnail_jobs) {
+    log("waiting for thumbnail job");
+    finish_thumbnail_job(tj); // (which starts the clip's copies)
+  }
+  thumbnail_jobs.clear();
   for (copy_thread *ct : copy_threads) {
     log("waiting for copy thread");
     ct->thread.join();
   }
-  cv::destroyAllWindows();
+  if (storage->has_budget()) {
+    std::lock_guard<std::mutex> lk(storage->mutex);
+    log("storage: ",storage->clips.size()," clips (",
+      format_byte_size(storage->total_bytes),"); pruned ",
+      storage->pruned_clips," (",format_byte_size(storage->pruned_bytes),")");
+  }
+  log_storage_messages();
+  storage.reset(); // finishes its deletes
+  hud.reset(); // closes the windows
   log("shut down complete");
   log_stream.flush();
 }
@@ -60,20 +161,39 @@ void motion_detector::reset_background(int countdown_s, const char *why) {
   log("resetting background (",why,")");
   for (int i = 0; i < countdown_s && !exit_detector; i++) {
     std::cout << (countdown_s - i) << "...\n";
-    auto key = cv::waitKey(1000);
+    auto key = wait_key(1000);
     process_key(key);
   }
-  image background_frame_color, background_frame;
-  vc.read(background_frame_color);
+  if (countdown_s > 0) {
+    scheduler.resync(); // the pause isn't lateness
+    frame_started = now();
+  }
+  image frame;
+  vc.read(frame);
+  adopt_background(frame);
+}
+
+void motion_detector::adopt_background(const image &frame) {
+  // a copy since frame may be a capture ring slot
+  frame.copyTo(background_frame_color);
+  image background_frame;
   cv::cvtColor(background_frame_color,background_frame,cv::COLOR_BGR2GRAY);
   cv::GaussianBlur(
     background_frame, background_frame_gray_blurred, cv::Size(21,21), 0.0);
+  background_luma = illumination_luma(background_frame_color);
+  motion_algorithm->reset(detection_frame(background_frame_color));
+
+  background_reset = true;
 
-  if (hud_enabled)
-    cv::imshow("background frame",background_frame_gray_blurred);
+  if (hud)
+    hud_next.background = background_frame_gray_blurred.clone();
 }
 
 void motion_detector::join_finished_asyncs() {
+  while (!thumbnail_jobs.empty() && thumbnail_jobs.front()->done) {
+    finish_thumbnail_job(thumbnail_jobs.front());
+    thumbnail_jobs.pop_front();
+  }
   while (!copy_threads.empty()) {
     auto *ct = copy_threads.front();
     if (!ct->done) {
@@ -85,131 +205,409 @@ void motion_detector::join_finished_asyncs() {
       log(ct->target_file_name,": ERROR: ", ct->error_message);
     }
     log(ct->target_file_name,": deleted copy thread");
+    storage->unpin(storage_clip_stem(ct->source_file_name));
     delete ct;
   }
+  log_storage_messages();
+}
+
+void motion_detector::log_storage_messages() {
+  for (const auto &m : storage->take_messages())
+    log(m);
 }
 
 void motion_detector::start_copy_to_remote_async(std::string file_name) {
   if (!os.remote_copy_dir.empty()) {
     log(file_name, ": starting copy thread");
+    // it mustn't be pruned out from under the copy
+    storage->pin(storage_clip_stem(file_name));
     copy_threads.push_back(new copy_thread(file_name,os.remote_copy_dir));
   }
 }
 
 const image &motion_detector::capture_frame(cv::VideoWriter *vw) {
+  const uint64_t seq = color_frames.total + 1; // also the frame bus seq
   image &i = color_frames.add();
+  if (frame_bus.is_open()) {
+    // nobody scored the last one; it still goes out
+    publish_frame(last_motion_score, FRAME_BUS_UNSCORED);
+    frame_bus.begin(seq);
+  }
 
   frame_overhead_estimate.stop();
 
-  vc.read(i);
+  {
+    perf_scope ps(&perf, PERF_CAPTURE);
+    vc.read(i);
+  }
 
   frame_overhead_estimate.start();
 
+  if (frame_bus.is_open()) {
+    if (i.data != frame_bus.pixels((int)((seq - 1) % PREVIOUS_FRAMES))) {
+      // the camera changed format and the capture reallocated the image
+      log("WARNING: frame size changed; closing the frame bus");
+      frame_bus.close();
+    } else {
+      frame_bus_pending = seq;
+      frame_bus_pending_time_us = event_time_now();
+    }
+  } else if (!os.frame_bus_name.empty() && seq == 1) {
+    open_frame_bus(); // now that we know the frame size
+  }
+
   if (vw) {
+    perf_scope ps(&perf, PERF_ENCODE);
     vw->write(i);
   }
 
   return i;
 }
 
-bool motion_detector::detecting_motion() {
-  // https://www.pyimagesearch.com/2015/05/25/basic-motion-detection-and-tracking-with-python-and-opencv/
-  // I can't tell if the gray version of currFrame is blurred
+void motion_detector::apply_config(config_update &cu) {
+  if (!cu.error.empty())
+    log("config: ERROR: ",cu.error);
+  for (const std::string &note : cu.notes)
+    log(note);
 
-  motion_cost_estimate.start();
+  const opts old = os;
+  auto changed = [&] (const char *key, auto from, auto to) {
+    if (from == to)
+      return false;
+    std::stringstream ss;
+    ss << "config: " << key << ": " << from << " -> " << to;
+    log(ss.str());
+    return true;
+  };
+  os.calibration_mad_units = cu.os.calibration_mad_units;
+  os.detector = cu.os.detector;
+  os.fps = cu.os.fps;
+  os.max_video_length = cu.os.max_video_length;
+  os.max_videos = cu.os.max_videos;
+  os.motion_mask_scale = cu.os.motion_mask_scale;
+  os.motion_threshold = cu.os.motion_threshold;
+  os.has_custom_motion_threshold = cu.os.has_custom_motion_threshold;
+  os.remote_copy_dir = cu.os.remote_copy_dir;
 
-  cv::cvtColor(color_frames.newest(),color_to_gray,cv::COLOR_BGR2GRAY);
-  cv::GaussianBlur(
-    color_to_gray,
-    gray_to_blurred,
-    cv::Size(21,21), 0.0);
+  if (changed("calibration-mads",
+    old.calibration_mad_units, os.calibration_mad_units))
+  {
+    calibrator.mad_units = os.calibration_mad_units;
+  }
+  if (cu.new_detector) {
+    changed("detector", old.detector, os.detector);
+    // the watcher loaded the new one's activity map; the old one's is newer
+    block_scorer *from = motion_algorithm->blocks();
+    block_scorer *to = cu.new_detector->blocks();
+    if (from && !from->blocks.empty() && detect_scale == 1) {
+      if (to)
+        to->copy_heatmap(*from);
+      else if (config)
+        config->retire(std::move(motion_algorithm)); // it saves the map
+    } else if (!cu.activity_map_note.empty()) {
+      log(cu.activity_map_note);
+    }
+    motion_algorithm = std::move(cu.new_detector);
+    if (perf.enabled)
+      motion_algorithm->perf = &perf;
+    // the ring's newest frame rather than waiting on the camera (the ring
+    // is empty only before the first frame after a warm start)
+    if (color_frames.total > 0) {
+      log("resetting background (detector changed)");
+      adopt_background(color_frames.newest());
+    } else {
+      reset_background(0,"detector changed");
+    }
+    if (to && to->blocks.empty()) // (the watcher didn't know the size yet)
+      load_activity_map();
+    // scores from another detector don't compare
+    calibrator = online_calibrator();
+    calibrator.mad_units = os.calibration_mad_units;
+  }
+  if (changed("motion-threshold",
+    old.has_custom_motion_threshold ?
+      format(old.motion_threshold,0,3) : std::string("auto"),
+    os.has_custom_motion_threshold ?
+      format(os.motion_threshold,0,3) : std::string("auto")))
+  {
+    if (os.has_custom_motion_threshold)
+      motion_threshold = os.motion_threshold;
+    else if (calibrator.calibrated())
+      motion_threshold = calibrator.threshold;
+  }
+  bool restart_writer = false;
+  if (changed("fps", old.fps, os.fps)) {
+    vc.set(cv::CAP_PROP_FPS, os.fps);
+    scheduler.start(os.fps);
+    restart_writer = true;
+  }
+  if (changed("max-video-length", old.max_video_length, os.max_video_length))
+  {
+    vidcap_disabled = os.max_video_length <= 0;
+    restart_writer = true;
+  }
+  restart_writer |= changed("max-videos", old.max_videos, os.max_videos);
+  changed("motion-mask-scale", old.motion_mask_scale, os.motion_mask_scale);
+  changed("remote-copy", old.remote_copy_dir, os.remote_copy_dir);
+  if (restart_writer && video_fourcc != -1)
+    prepare_warm_writer(); // opens in the background
+}
 
-  cv::absdiff(gray_to_blurred, background_frame_gray_blurred, absdiff);
-  double adiff_susm = cv::sum(absdiff)[0];
-  double adiff_ratio = adiff_susm/absdiff.size().area();
+void motion_detector::open_frame_bus() {
+  const image &first = color_frames.newest();
+  if (first.type() != CV_8UC3) {
+    log(os.frame_bus_name,": WARNING: unexpected frame format (no frame bus)");
+    return;
+  }
+  std::string error;
+  if (!frame_bus.open(os.frame_bus_name,
+    first.cols, first.rows, PREVIOUS_FRAMES, error))
+  {
+    log(os.frame_bus_name,": WARNING: ",error," (no frame bus)");
+    return;
+  }
+  // point the capture ring into the shared memory; the camera decodes
+  // straight into it from now on
+  for (int k = 0; k < PREVIOUS_FRAMES; k++) {
+    image old = color_frames.elements[k];
+    color_frames.elements[k] = image(first.rows, first.cols, CV_8UC3,
+      frame_bus.pixels(k), frame_bus.stride());
+    if (!old.empty())
+      old.copyTo(color_frames.elements[k]);
+  }
+  frame_bus_pending = color_frames.total;
+  frame_bus_pending_time_us = event_time_now();
+  log(os.frame_bus_name,": publishing frames (",
+    first.cols,"x",first.rows,", ",PREVIOUS_FRAMES," slots)");
+}
+
+void motion_detector::publish_frame(double score, uint32_t flags) {
+  if (!frame_bus_pending)
+    return;
+  frame_bus_metadata md { };
+  md.time_us = frame_bus_pending_time_us;
+  md.motion_score = (float)score;
+  md.threshold = (float)motion_threshold;
+  md.flags = flags;
+  md.zone_count = 0; // no zones (yet)
+  frame_bus.publish(frame_bus_pending, md);
+  frame_bus_pending = 0;
+}
+
+bool motion_detector::detecting_motion() {
+  motion_cost_estimate.start();
+
+  // until the online calibration has a threshold, we can't detect anything
+  const bool calibrating =
+    !os.has_custom_motion_threshold && !calibrator.calibrated();
+  // an early exit only bounds the score; the calibrator, the HUD and the
+  // logs get an exact one every SCORE_EXACT_PERIOD frames (and every frame
+  // until there's a threshold) and the bounds are flagged
+  const bool exact = calibrating ||
+    color_frames.total % SCORE_EXACT_PERIOD == 0;
+  const image &frame = detection_frame(color_frames.newest());
+  double adiff_ratio = motion_algorithm->score(frame,
+    exact ? 0.0 : motion_threshold);
+  block_scorer *blocks = motion_algorithm->blocks();
+  bool bounded = blocks && blocks->early_exit;
+  if (bounded)
+    early_exits++;
   // TODO: remove once the HUD works
   // if (color_frames.total % 32 ==  0)
   //  std::cout << std::fixed << std::setprecision(3) << "DIFF: " << adiff_ratio << "\n";
 
-  min_motion_diff = std::min(adiff_ratio,min_motion_diff);
-  max_motion_diff = std::max(adiff_ratio,max_motion_diff);
+  bool motion_detected = !calibrating && adiff_ratio > motion_threshold;
+  // checked before the background is reset below
+  const bool was_background_reset = background_reset;
+  bool lighting = false;
+  if (motion_detected && rejected_as_lighting(adiff_ratio)) {
+    motion_detected = false;
+    lighting = true;
+  }
+  lighting_adopted = lighting;
+  if (motion_detected && bounded) {
+    // the log, the event record and the ROI want the score and the box of
+    // the whole frame; a trigger is rare enough to read it again
+    adiff_ratio = motion_algorithm->score(frame, 0.0);
+    bounded = false;
+  }
 
-  motion_samples.add(adiff_ratio);
+  if (!bounded) {
+    min_motion_diff = std::min(adiff_ratio,min_motion_diff);
+    max_motion_diff = std::max(adiff_ratio,max_motion_diff);
+    motion_samples.add(adiff_ratio);
+    if (hud)
+      hud_next.scores.push_back(adiff_ratio);
+  }
   // if (motion_samples.average() > motion_threshold) {
   //    careful here, if we outrun our color buffer history, we're screwed
   // }
 
-  bool motion_detected = adiff_ratio > motion_threshold;
+  last_motion_score = adiff_ratio;
+  last_score_bounded = bounded;
   if (motion_detected) {
+    const cv::Rect box = motion_box();
     log("motion detected (", format(adiff_ratio,0,3), " > ",
-      format(motion_threshold,0,3), ")");
+      format(motion_threshold,0,3), ") in ",
+      box.width,"x",box.height," at (",box.x,",",box.y,")");
+  }
+  // the blocks' noise says nothing about the light switch either
+  if (motion_algorithm->learn(motion_detected || lighting) && blocks) {
+    log("activity map: ",blocks->masked.size()," noisy blocks masked, ",
+      blocks->sparse.size()," static blocks sampled every ",
+      ACTIVITY_SPARSE_PERIOD," frames");
+  }
+  if (!motion_detected && !lighting && !bounded &&
+    !os.has_custom_motion_threshold && calibrator.add(adiff_ratio))
+  {
+    log("adjusting motion threshold ",
+      format(motion_threshold,0,3), " -> ",
+      format(calibrator.threshold,0,3),
+      " (median ", format(calibrator.median,0,3),
+      ", MAD ", format(calibrator.mad,0,3), ")");
+    motion_threshold = calibrator.threshold;
   }
 
+  if (score_log.is_open()) {
+    uint8_t flags =
+      (calibrating ? SCORE_FLAG_CALIBRATING : 0) |
+      (motion_detected ? SCORE_FLAG_TRIGGERED : 0) |
+      (was_background_reset ? SCORE_FLAG_BACKGROUND_RESET : 0) |
+      (lighting ? SCORE_FLAG_LIGHTING : 0) |
+      (bounded ? SCORE_FLAG_BOUNDED : 0);
+    score_log.add(event_time_now(), adiff_ratio, flags);
+  }
+  // the next frame is the first against a background adopted here
+  background_reset = lighting;
+
   motion_cost_estimate.stop();
 
   return motion_detected;
 }
 
- void motion_detector::capture_video(const char *why) {
+int motion_detector::capture_video(const char *why) {
+  auto trigger_time = now();
   if (vidcap_disabled || os.max_video_length <= 0) {
     log("aborting capture (vid. capture disabled)");
-    return;
+    return -1;
   }
   int video_index = next_video_index++;
-  std::stringstream ss;
-  ss << "motion" << std::setw(5) << std::setfill('0') << video_index << ".mp4";
-  auto file_name = fs::join_path(os.motion_video_dir,ss.str());
+  auto stem = video_file_stem(video_index);
+  auto file_name = stem + ".mp4";
+  std::string mask_file_name;
+  if (os.motion_mask_scale > 0)
+    mask_file_name = stem + ".mask";
+  std::string roi_file_name;
+  if (os.roi_stream)
+    roi_file_name = stem + "-roi.mp4";
+  recording_peak_score = 0.0;
+  recording_peak_frame = 0;
+  recording_flags = 0;
+  clip_thumbnail_job = nullptr;
   log("capturing video (",why,") as ", file_name);
-  fs::remove_if_exists(file_name);
-  capture_video_body(file_name);
-  start_copy_to_remote_async(file_name);
-}
+  storage->pin(stem);
+  if (os.thumbnails)
+    start_keyframes();
 
-void motion_detector::capture_video_body(std::string file_name) {
-  cv::VideoWriter vw;
-
-  auto open_video_output =
-    [&](const char *ccs)
-    {
-      int four_cc = cv::VideoWriter::fourcc(
-            ccs[0],
-            ccs[1],
-            ccs[2],
-            ccs[3]);
-      vw.open(
-        file_name,
-        four_cc,
-        (double)TARGET_FPS,
-        color_frames.newest().size(),
-        true);
-      return vw.isOpened();
-    };
-
-  // http://www.fourcc.org/codecs.php
-  static const char* FOUR_CCS[] {
-    "H264",
-    "X264",
-    "XVID",
-    "MP4V",
-  };
-
-  if (!os.preferred_fourcc.empty() && open_video_output(os.preferred_fourcc.c_str())) {
-    log("opened video (in preferred format)");
-  } else {
-    log("falling back to other formats");
-    for (int i = 0; i < sizeof(FOUR_CCS)/sizeof(FOUR_CCS[0]); i++) {
-      log("trying ", FOUR_CCS[i]);
-      if (open_video_output(FOUR_CCS[i])) {
-        log("opened video (in ",FOUR_CCS[i],")");
-        break;
-      }
+  if (warm_writer && warm_writer->file_name == file_name) {
+    // normally it finished opening long ago
+    warm_writer->thread.join();
+    if (warm_writer->vw.isOpened()) {
+      capture_video_body(warm_writer->vw,
+        file_name, mask_file_name, roi_file_name, trigger_time, true);
+    } else {
+      log(file_name,": ERROR: warm video writer failed to open");
+      video_index = -1;
     }
-    if (!vw.isOpened()) {
+    warm_writer.reset();
+  } else {
+    discard_warm_writer();
+    cv::VideoWriter vw;
+    // the writer truncates a stale video from an earlier run
+    if (open_video_writer(vw, file_name, color_frames.newest().size())) {
+      capture_video_body(vw, file_name, mask_file_name, roi_file_name,
+        trigger_time, false);
+    } else {
       log("ERROR: failed to open video writer after several tries; giving up");
-      return;
+      video_index = -1;
     }
   }
+  if (video_index >= 0) {
+    std::vector<std::string> files {file_name};
+    if (!mask_file_name.empty())
+      files.push_back(mask_file_name);
+    if (recording_flags & EVENT_FLAG_ROI_VIDEO)
+      files.push_back(roi_file_name);
+    if (keyframes) {
+      // the job adds the clip and starts its copies once it's done
+      start_thumbnail_job(stem, files);
+    } else {
+      storage->add_clip(stem, files);
+      for (const auto &f : files)
+        start_copy_to_remote_async(f);
+    }
+  }
+  keyframes.reset();
+  storage->unpin(stem);
+  prepare_warm_writer();
+  return video_index;
+}
 
+int64_t motion_detector::begin_event(int64_t time_us) {
+  if (!event_index.is_open())
+    return -1;
+  event_record er;
+  er.time_us = time_us;
+  er.peak_score = (float)last_motion_score;
+  er.threshold = (float)motion_threshold;
+  er.camera = (uint16_t)os.camera;
+  er.zone = -1;
+  er.video_index = -1; // until the clip is written
+  er.frame_offset = 0;
+  er.flags = (uint32_t)(os.log_rotate_dir + 1) << EVENT_FLAG_DIR_SHIFT;
+  return event_index.append(er);
+}
+
+void motion_detector::record_event(
+  int64_t offset, int64_t time_us, int video_index)
+{
+  if (offset < 0)
+    return;
+  event_record er;
+  er.time_us = time_us;
+  er.threshold = (float)motion_threshold;
+  er.camera = (uint16_t)os.camera;
+  er.zone = -1;
+  er.video_index = video_index;
+  if (recording_peak_score > last_motion_score) {
+    // adaptive recording scored the clip's frames
+    er.peak_score = (float)recording_peak_score;
+    er.frame_offset = recording_peak_frame;
+  } else {
+    // recording starts on the frame that triggered
+    er.peak_score = (float)last_motion_score;
+    er.frame_offset = 0;
+  }
+  er.flags = recording_flags |
+    (uint32_t)(os.log_rotate_dir + 1) << EVENT_FLAG_DIR_SHIFT;
+  if (clip_thumbnail_job) {
+    // completed once the thumbnails are written (or not)
+    clip_thumbnail_job->event_offset = offset;
+    clip_thumbnail_job->event = er;
+    clip_thumbnail_job = nullptr;
+    return;
+  }
+  event_index.update(offset, er);
+}
+
+void motion_detector::capture_video_body(
+  cv::VideoWriter &vw,
+  std::string file_name,
+  std::string mask_file_name,
+  std::string roi_file_name,
+  time_point trigger_time,
+  bool warm)
+{
   // TODO: this is busted, can't figure out why
   //
   // write the past frames
@@ -217,11 +615,59 @@ void motion_detector::capture_video_body(std::string file_name) {
   //  vw.write(color_frame);
   // });
 
-  double last_elapsed = 0.0f;
+  // the motion mask is cheap enough to compute inline (an 8x downsample
+  // costs a small fraction of the encode)
+  motion_mask_writer mask;
+  if (!mask_file_name.empty()) {
+    std::string error;
+    mask.open(mask_file_name, background_frame_gray_blurred,
+      color_frames.newest().size(), os.motion_mask_scale,
+      os.fps, error);
+    if (!error.empty())
+      log(mask_file_name,": ERROR: ",error);
+  }
+
+  uint64_t written_seq = color_frames.total; // the clip's newest frame
+  std::unique_ptr<adaptive_recording> adaptive;
+  if (os.adaptive_recording) {
+    adaptive.reset(new adaptive_recording());
+    start_adaptive_recording(*adaptive, roi_file_name);
+  }
+
   auto video_started = uptime();
 
   while (true) {
-    capture_frame(&vw);
+    if (adaptive) {
+      // it decides what goes into the clip
+      capture_frame();
+      double score = write_adaptive_frame(*adaptive, vw);
+      track_keyframes(score);
+      publish_frame(score, FRAME_BUS_RECORDING);
+    } else if (governor.active(GOVERNOR_ENCODER_FPS)) {
+      // every other frame repeats the one before it
+      capture_frame();
+      if (color_frames.total % 2 == 0)
+        written_seq = color_frames.total;
+      perf_scope ps(&perf, PERF_ENCODE);
+      vw.write(color_frames.elements[(written_seq - 1) % PREVIOUS_FRAMES]);
+      publish_frame(last_motion_score,
+        FRAME_BUS_RECORDING | FRAME_BUS_UNSCORED);
+    } else {
+      capture_frame(&vw);
+      written_seq = color_frames.total;
+      publish_frame(last_motion_score,
+        FRAME_BUS_RECORDING | FRAME_BUS_UNSCORED);
+    }
+    mask.add(color_frames.newest());
+    if (trigger_time != time_point()) {
+      auto latency =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          now() - trigger_time);
+      log(file_name,": first frame written ",
+        format(latency.count()/1000.0,0,1)," ms after the trigger (",
+        warm ? "warm" : "cold"," writer)");
+      trigger_time = time_point();
+    }
 
     double elapsed = uptime() - video_started;
     if (elapsed > os.max_video_length) {
@@ -229,139 +675,182 @@ void motion_detector::capture_video_body(std::string file_name) {
       break;
     }
 
-    auto stall = FRAME_BUDGET_MS - 1000.0*(elapsed - last_elapsed);
-    int stall_int = std::max((int)stall,1); // 0 means forever; so use 1
-    // std::cout << "stall: " << stall_int << "\n";
-    auto key = cv::waitKey(stall_int);
+    auto skipped = scheduler.skipped_frames;
+    auto key = wait_next_frame();
+    // the writer assumes a constant frame rate; so repeat the frame for
+    // any deadlines we missed to keep the clip's timing right
+    for (; skipped < scheduler.skipped_frames; skipped++) {
+      if (adaptive) {
+        repeat_adaptive_frame(*adaptive, vw);
+      } else {
+        perf_scope ps(&perf, PERF_ENCODE);
+        vw.write(color_frames.elements[(written_seq - 1) % PREVIOUS_FRAMES]);
+      }
+      mask.repeat_last();
+    }
     process_key(key);
     if (exit_detector || key == 'c') {
       log(file_name,": stopping video recording (by command)");
       break;
     }
 
-    if (hud_enabled) {
-      draw_hud(elapsed);
-    }
-
-    last_elapsed = elapsed;
+    publish_hud(elapsed);
   }
   vw.release();
+  if (adaptive)
+    finish_adaptive_recording(*adaptive, file_name);
+  if (mask.is_open()) {
+    mask.close();
+    log(mask_file_name,": wrote ",mask.bytes_written," bytes of motion mask");
+  }
 }
 
-void motion_detector::calibrate_motion_threshold()
-{
-  log("calibrating motion threshold");
-  for (int i = 0; i < MOTION_SAMPLES; i++) {
-    (void)capture_frame();
-    (void)detecting_motion();
+void motion_detector::publish_hud(double video_offset) {
+  if (!hud)
+    return;
+  // cap the refresh rate; scores accumulate between snapshots
+  auto now_time = now();
+  const int refresh_hz =
+    governor.active(GOVERNOR_HUD) ? GOVERNOR_HUD_HZ : HUD_REFRESH_HZ;
+  if (now_time - last_hud_publish <
+    std::chrono::milliseconds(1000/refresh_hz))
+  {
+    return;
   }
-  double avg = motion_samples.average();
-  log("     average motion is ",format(avg,0,3));
-  motion_threshold = 1.2*avg;
-  log("     setting threshold to ",format(motion_threshold,0,3));
-}
+  last_hud_publish = now_time;
 
-void motion_detector::draw_hud(double video_offset) {
   hud_draw_cost_estimate.start();
+  perf_scope ps(&perf, PERF_HUD);
+  hud_next.enabled = hud_enabled;
+  if (hud_enabled) {
+    // the capture ring reuses these buffers; the HUD needs its own copy
+    color_frames.newest().copyTo(hud_next.frame);
+    motion_algorithm->motion_image(hud_next.motion);
+  }
+  hud_next.threshold = motion_threshold;
+  hud_next.video_offset = video_offset;
+  hud->publish(hud_next);
+  hud_draw_cost_estimate.stop();
+}
 
-  // zero it
-  stats_window.setTo(cv::Scalar::all(0));
-
-  static const double GRAPH_HEIGHT = 200.0f;
-  static const double GRAPH_WIDTH = 600.0f;
-  static const double DX = GRAPH_WIDTH/MOTION_SAMPLES;
-  static const double BASE_X = 20.0f, BASE_Y = 10.0f;
-  // colors are in BGR format
-  static const cv::Scalar WHITE(255,255,255);
-  static const cv::Scalar YELLOW(0,255,255);
-  static const cv::Scalar RED(0,0,255);
-  static const cv::Scalar GREEN(0,255,0);
-  auto toInt = [](double x){return (int)std::round(x);};
-  auto point = [&](double x, double y) {
-    return cv::Point(toInt(x), toInt(y));
-  };
-  static const cv::Rect GRAPH_BORDER(
-    toInt(BASE_Y - 1.0),       toInt(BASE_X - 1.0),
-    toInt(GRAPH_WIDTH + 2.0),  toInt(GRAPH_HEIGHT + 2.0));
-  cv::rectangle(stats_window, GRAPH_BORDER, WHITE);
-  auto valueToHeight =
-    [&] (double value) {
-      const double MAX = 1.5*motion_threshold;
-      return BASE_Y + GRAPH_HEIGHT -
-        (std::min(value,MAX)/MAX)*GRAPH_HEIGHT;
-    };
-  auto threshold_y = valueToHeight(motion_threshold);
-  cv::line(stats_window,
-    point(BASE_X,               threshold_y),
-    point(BASE_X + GRAPH_WIDTH, threshold_y),
-    YELLOW);
-  auto colorForValue = [&](double value) {
-    double t = std::min(1.0,value/motion_threshold);
-    return cv::Scalar(
-      toInt((1.0-t*t)*255.0),
-      0,
-      toInt(t*t*255.0)
-    );
-  };
-  cv::Point last = point(valueToHeight(motion_samples.oldest()),BASE_X);
-  motion_samples.for_each(
-    [&] (const double &y) {
-      cv::Point this_point = point(last.x + DX, valueToHeight(y));
-
-      // auto &color =
-      //   d >= motion_threshold ? RED :
-      //   d >= 0.8*motion_threshold ? YELLOW :
-      //   GREEN;
-      cv::line(stats_window,last,this_point,colorForValue(y));
-      last = this_point;
-    });
-
-  auto last_motion = motion_samples.newest();
-  auto s = format(last_motion,0,3);
-  cv::putText(stats_window, s,
-    cv::Point(20,20), cv::FONT_HERSHEY_PLAIN, 1.0,
-    last_motion > motion_threshold ? RED : YELLOW);
-  if (video_offset != 0.0) {
-    std::stringstream voff;
-    voff << "recording (" << format(video_offset,0,1) << ")";
-    cv::putText(stats_window, voff.str(),
-      cv::Point(20,60), cv::FONT_HERSHEY_PLAIN, 1.0, RED);
-  }
-
-  cv::imshow("stats",stats_window);
-  cv::imshow("current frame",color_frames.newest());
-  cv::imshow("motion",absdiff);
+int motion_detector::wait_key(int ms) {
+  if (hud)
+    return hud->wait_key(ms);
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  return -1;
+}
 
-  hud_draw_cost_estimate.stop();
+int motion_detector::wait_next_frame() {
+  const int64_t busy_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      now() - frame_started).count();
+  const uint64_t late_frames = scheduler.late_frames;
+  auto deadline = scheduler.advance();
+  update_governor(busy_us, scheduler.late_frames != late_frames);
+  int key = -1;
+  if (hud) {
+    key = hud->wait_key_until(deadline);
+  } else {
+    // --headless never touches HighGUI
+    std::this_thread::sleep_until(deadline);
+  }
+  if (key == -1)
+    scheduler.woke();
+  frame_started = now();
+  return key;
+}
+
+void motion_detector::load_activity_map() {
+  last_state_save = now();
+  block_scorer *blocks = motion_algorithm->blocks();
+  // a downscaled detector learns a map of its own (and doesn't keep it)
+  if (!blocks || detect_scale != 1)
+    return;
+  blocks->reset(background_frame_gray_blurred.size());
+  if (os.activity_map_path.empty())
+    return;
+  std::string error;
+  if (!blocks->load(os.activity_map_path, os.camera, error)) {
+    log(os.activity_map_path,": ",error," (learning a new activity map)");
+    return;
+  }
+  log(os.activity_map_path,": loaded activity map (",
+    blocks->masked.size()," noisy blocks masked, ",
+    blocks->sparse.size()," static)");
+}
+
+void motion_detector::save_activity_map() {
+  block_scorer *blocks = motion_algorithm->blocks();
+  if (os.activity_map_path.empty() || !blocks || blocks->blocks.empty() ||
+    detect_scale != 1)
+  {
+    return;
+  }
+  std::string error;
+  if (!blocks->save(os.activity_map_path, os.camera, error))
+    log(os.activity_map_path,": WARNING: ",error," (activity map not saved)");
 }
 
 void motion_detector::run() {
   // prime it by burning some frames
   // the lighting adjusts as the program starts up and this causes spikes
   log("warming up");
-  auto warmup_start = uptime();
-  while (uptime() - warmup_start < os.startup_delay) {
-    auto &curr_frame = capture_frame();
-    if (!os.headless)
-      cv::imshow("current frame",curr_frame);
+  scheduler.start(os.fps);
+  frame_started = now();
+  if (!load_warm_start()) {
+    auto warmup_start = uptime();
+    while (uptime() - warmup_start < os.startup_delay) {
+      (void)capture_frame();
+      publish_hud();
+      process_key(wait_next_frame());
+    }
+    reset_background(0,"initial background");
   }
+  load_activity_map();
+  if (config)
+    config->set_frame_size(background_frame_gray_blurred.size());
 
-  reset_background(0,"initial background");
-  if (!os.has_custom_motion_threshold)
-    calibrate_motion_threshold();
+  if (os.max_video_length > 0) {
+    probe_video_codecs();
+    prepare_warm_writer();
+  }
+  scheduler.resync(); // the startup work isn't lateness
+  frame_started = now();
 
   log("running");
 
   while (!exit_detector) {
-    (void)capture_frame();
-    bool motion = detecting_motion();
-    if (hud_enabled) {
-      draw_hud();
+    if (config && config->has_pending) {
+      auto cu = config->take();
+      if (cu)
+        apply_config(*cu);
     }
+    sync_detect_scale();
+    (void)capture_frame();
+    // the governor's skip-detect step scores every other frame
+    bool motion = false;
+    const bool scored =
+      !governor.active(GOVERNOR_SKIP_DETECT) || color_frames.total % 2 == 0;
+    if (scored)
+      motion = detecting_motion();
+    // an unscored frame repeats the last score (flagged) rather than a 0
+    publish_frame(last_motion_score,
+      (scored ? 0 : FRAME_BUS_UNSCORED) |
+      (scored && last_score_bounded ? FRAME_BUS_BOUNDED : 0) |
+      (motion ? FRAME_BUS_TRIGGERED : 0) |
+      (!os.has_custom_motion_threshold && !calibrator.calibrated() ?
+        FRAME_BUS_CALIBRATING : 0));
+    publish_hud();
 
     if (motion) {
-      capture_video("motion detected");
-      if (next_video_index == os.max_videos) {
+      // the record goes in at the trigger (the index stays in time order)
+      // and is completed once the clip is written
+      int64_t event_time = event_time_now();
+      int64_t event_offset = begin_event(event_time);
+      int video_index = capture_video("motion detected");
+      record_event(event_offset, event_time, video_index);
+      // >= since a reload may lower it below the count
+      if (next_video_index - first_video_index >= os.max_videos) {
         log("exiting because we created the maximum number of videos");
         exit_detector = true;
       }
@@ -370,12 +859,17 @@ void motion_detector::run() {
       // from spamming the motion detection
       reset_background(0,"motion detected");
     } else {
-      auto key = cv::waitKey((int)FRAME_BUDGET_MS);
+      auto key = wait_next_frame();
       process_key(key);
       if (key == 'c') {
         capture_video("forced");
       }
     }
+    if (now() - last_state_save > std::chrono::minutes(10)) {
+      last_state_save = now();
+      save_activity_map();
+      save_warm_start();
+    }
     if (color_frames.total % (4*32)) { // about 4s
       join_finished_asyncs();
       log_stream.flush();
@@ -402,13 +896,16 @@ void motion_detector::process_key(int key)
   } else if (key == 'r' || key == 'R') {
     reset_background(key == 'r' ? os.startup_delay : 0,"forced");
   } else if (key == 'k') {
-    log("recalibrating of motion threshold (forced)");
-    calibrate_motion_threshold();
+    if (os.has_custom_motion_threshold) {
+      log("ignoring recalibration (fixed --motion-threshold)");
+    } else {
+      // detection continues with the current threshold as the window refills
+      log("recalibrating of motion threshold (forced)");
+      calibrator.reset();
+    }
   } else if (key == 'h') {
+    // the HUD thread closes (or reopens) the windows on its next snapshot
     toggle("hud_enabled",hud_enabled);
-    if (!hud_enabled) {
-      cv::destroyAllWindows();
-    }
   } else if (key == 'v') {
     toggle("vidcap_disabled",vidcap_disabled);
   } else if (key == 'c') {
@@ -418,20 +915,63 @@ void motion_detector::process_key(int key)
   } else if (key == 'd') {
     std::cout << "uptime:                 " << format(uptime()) << " s\n";
     std::cout << "frame index:            " << color_frames.total << "\n";
+    std::cout << "frame budget:           " << format(scheduler.budget_ms(),0,1) << " ms (" << format(os.fps,0,1) << " fps)\n";
+    std::cout << "   late frames:         " << scheduler.late_frames << "\n";
+    std::cout << "   skipped frames:      " << scheduler.skipped_frames << "\n";
+    std::cout << "   wake-up jitter:      " << format(scheduler.wake_latency_us.average()/1000.0,0,2) << " ms (" << format(scheduler.max_wake_latency_us/1000.0,0,2) << " ms max)\n";
+    std::cout << "governor:               level " << governor.level << " of " << governor.ladder.size() << " (" << format(100.0*governor.utilization,0,0) << "% of budget; " << governor.transitions << " transitions)\n";
+    for (int i = 0; i < governor.level; i++)
+      std::cout << "   step " << (i + 1) << ":              " << GOVERNOR_STEP_NAMES[governor.ladder[i]] << "\n";
+    std::cout << "threads\n";
+    for (int r = 0; r < THREAD_ROLES; r++) {
+      std::string nm = THREAD_ROLE_NAMES[r];
+      nm += ":";
+      std::cout << "   " << std::setw(21) << std::left << nm << std::right << thread_role_status((thread_role)r) << "\n";
+    }
     std::cout << "\n";
-    std::cout << "motion_threshold:       " << format(motion_threshold) << "\n";
+    std::cout << "motion_threshold:       " << format(motion_threshold,0,3) << "\n";
+    std::cout << "   quiet median:        " << format(calibrator.median,0,3) << "\n";
+    std::cout << "   quiet MAD:           " << format(calibrator.mad,0,3) << "\n";
     std::cout << "\n";
     std::cout << "est. mdet   cost:       " << format(motion_cost_estimate.average_ms(),0,1) << " ms\n";
-    std::cout << "est. draw   cost:       " << format(hud_draw_cost_estimate.average_ms(),0,1) << " ms\n";
+    std::cout << "   detector:            " << motion_algorithm->name() << " (" << format(motion_algorithm->cost.average_ms(),0,2) << " ms scoring)\n";
+    if (block_scorer *blocks = motion_algorithm->blocks()) {
+      std::cout << "   masked blocks:       " << blocks->masked.size() << " of " << blocks->blocks.size() << "\n";
+      std::cout << "   static blocks:       " << blocks->sparse.size() << "\n";
+      std::cout << "   early exits:         " << early_exits << " (last frame scored " << blocks->blocks_scored << " blocks)\n";
+    }
+    std::cout << "est. hud    cost:       " << format(hud_draw_cost_estimate.average_ms(),0,1) << " ms (publishing)\n";
+    if (hud)
+      std::cout << "est. draw   cost:       " << format(hud->draw_cost_ms,0,1) << " ms (HUD thread)\n";
     std::cout << "est. frame ovrhd:       " << format(frame_overhead_estimate.average_ms(),0,1) << " ms\n";
+    if (perf.enabled) {
+      std::cout << "stage counters (averages per sample):\n";
+      perf.report(std::cout);
+    }
     std::cout << "\n";
     std::cout << "hud_enabled             " << format(hud_enabled) << "\n";
     std::cout << "vidcap_disabled         " << format(vidcap_disabled) << "\n";
+    std::cout << "video codec             " <<
+      (video_fourcc == -1 ? "(none probed)" : video_fourcc_name) << "\n";
+    if (warm_writer) {
+      std::cout << "warm writer             " << warm_writer->file_name <<
+        (warm_writer->done ? " (ready)" : " (opening)") << "\n";
+    }
     std::cout << "motion diffs\n";
     std::cout << "   buffer avg:          " << format(motion_samples.average(),0,3) << "\n";
     std::cout << "   min:                 " << format(min_motion_diff,0,3) << "\n";
     std::cout << "   max:                 " << format(max_motion_diff,0,3) << "\n";
+    std::cout << "lighting changes:       " << lighting_changes <<
+      (os.record_lighting_changes ? " (recorded)" : " (rejected)") << "\n";
     //
+    {
+      std::lock_guard<std::mutex> lk(storage->mutex);
+      std::cout << "storage:                " << storage->clips.size() <<
+        " clips (" << format_byte_size(storage->total_bytes) << " of " <<
+        storage_budget(os) << "; " << storage->pinned.size() << " pinned, " <<
+        storage->pruned_clips << " pruned)\n";
+    }
+    std::cout << "thumbnail_jobs:         " << thumbnail_jobs.size() << "\n";
     std::cout << "copy_threads:           " << copy_threads.size() << "\n";
     for (const auto *ct : copy_threads) {
       std::cout << "  * " << ct->target_file_name <<
@@ -449,7 +989,7 @@ void motion_detector::process_key(int key)
       "keys are:\n"
       "  c     - forces video capture (or stops running capture)\n"
       "  d     - dumps debug info to stdout\n"
-      "  k     - forces recalibration of motion threshold\n"
+      "  k     - restarts the online motion threshold calibration\n"
       "  h     - toggles the stats HUD\n"
       "  q/ESC - quits\n"
       "  r/R   - resets the background image with a delay (R for no delay)\n"
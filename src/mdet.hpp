@@ -5,27 +5,116 @@
 #include <opencv2/imgproc/imgproc.hpp>
 // #include <opencv2/core/opencl/opencl_info.hpp>
 
+#include "blockscore.hpp"
+#include "calibrator.hpp"
+#include "events.hpp"
+#include "framebus.hpp"
+#include "motionmask.hpp"
+#include "perfcounters.hpp"
+#include "scorelog.hpp"
+
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
 #include <thread>
+#include <vector>
+
+static const int TARGET_FPS = 30; // the default for opts::fps
+static const char *const DEFAULT_DETECTOR = "blur-absdiff";
+
+// topology.cpp
+//
+// Each mdet thread has a role; a role's settings (CPU affinity, nice value,
+// scheduling policy) are applied by the thread itself as it starts, along
+// with its name (e.g. mdet-copy in top -H).  The capture thread also
+// detects and encodes (recording is inline); mdet has no logger thread.
+//
+// By default only the priorities differ: the capture thread runs above the
+// others (see default_thread_settings).  Nothing is pinned unless asked;
+// a pinned capture thread pins the OpenCV and FFmpeg worker threads it
+// creates along with it.
+// Settings that aren't permitted (e.g. a negative nice value without
+// CAP_SYS_NICE) are skipped and reported in the thread's status.
+enum thread_role {
+  THREAD_CAPTURE = 0, // capture, detection and encoding (the main loop)
+  THREAD_HUD,
+  THREAD_COPY,        // remote copies (one thread each)
+  THREAD_WRITER,      // opening the next video writer
+  THREAD_CONFIG,      // the --config watcher
+  THREAD_STORAGE,     // retention and deletes (storage.cpp)
+  THREAD_THUMBNAIL,   // thumbnail jobs (thumbnails.cpp)
+  THREAD_ROLES
+};
+static const char *const THREAD_ROLE_NAMES[THREAD_ROLES] {
+  "capture",
+  "hud",
+  "copy",
+  "writer",
+  "config",
+  "storage",
+  "thumbnail",
+};
+
+struct thread_settings {
+  std::vector<int> cpus;           // empty means any
+  bool             has_nice = false;
+  int              nice = 0;
+  std::string      policy;         // other, batch, idle, fifo, rr; "" leaves it
+  int              priority = 0;   // for fifo and rr
+};
+using thread_topology = std::array<thread_settings,THREAD_ROLES>;
+
+// the defaults for this machine
+thread_topology default_thread_settings();
+// parses --thread-cpus/nice/policy=ROLE:VALUE into tt
+bool parse_thread_setting(
+  const std::string &what, const std::string &value,
+  thread_topology &tt, std::string &error);
+// sets the topology later threads take their role's settings from
+void set_thread_topology(const thread_topology &tt);
+// applies role r's settings to the calling thread
+void enter_thread_role(thread_role r);
+// what the last thread in role r got (e.g. "cpus 3, nice -5 (not permitted)")
+std::string thread_role_status(thread_role r);
 
 struct opts {
   std::string       log_file_path = "mdet.log";
+  std::string       event_index_path = "mdet-events.idx";
+  std::string       detector = DEFAULT_DETECTOR;
+  std::string       activity_map_path = "mdet-activity.map"; // "" to not keep
+  std::string       warm_start_path = "mdet-warm.state"; // "" to not keep
+  std::string       frame_bus_name; // shared memory name; "" disables
+  std::string       config_path;    // reloaded on change (or SIGHUP)
+  std::string       score_log_path; // empty means disabled
+  int               camera = 0;
   std::string       motion_video_dir;
   std::string       remote_copy_dir;
   std::string       preferred_fourcc;
   int               max_videos = 512; // 30s takes about 33mb, so this maxes out at about 20g
                                       // it's much smaller with H264
   int               max_video_length = 30;
+  int               motion_mask_scale = 8; // 0 disables motion mask files
   int               startup_delay = 5;
+  double            fps = TARGET_FPS; // frame pacing and video writer rate
+  // local clip retention (see storage.cpp); 0 means no limit
+  int64_t           storage_max_bytes = 0;
+  double            storage_max_age_s = 0.0;
+  int64_t           storage_min_free_bytes = 0;
+  std::vector<std::string> storage_dirs; // other clip directories (rotation)
+  int               log_rotate_dir = -1; // logs##### (--log-rotate)
   // from testing we find these constants (640x480)
   //   covered webcam                  ~15000.0
   //   sitting totally still           ~60000.0
@@ -34,13 +123,20 @@ struct opts {
   // this is for a 640x480 image
   double            motion_threshold = 4.0;
   bool              has_custom_motion_threshold = false;
+  // sensitivity of the online calibration (in MAD units above the median)
+  double            calibration_mad_units = 6.0;
+  bool              adaptive_recording = false; // see recording.cpp
+  bool              roi_stream = false;         // (implies adaptive_recording)
+  bool              record_lighting_changes = false; // see illumination.cpp
+  bool              thumbnails = false;         // see thumbnails.cpp
   bool              headless = false;
+  bool              perf_counters = false; // stage counters (perfcounters.hpp)
+  thread_topology   threads; // per role (the defaults with --thread-* over them)
+  // the budget governor's degradation steps in order (see governor.cpp)
+  std::vector<std::string> governor_ladder; // empty means off
   int               exit_after = 0;
 };
 
-static const int TARGET_FPS = 30;
-static const double FRAME_BUDGET_MS = 1000.0/TARGET_FPS;
-
 static const int ESC_KEY = 0x1B;
 
 using time_point = std::chrono::steady_clock::time_point;
@@ -116,6 +212,64 @@ struct copy_thread {
   void run();
 };
 
+// thumbnails.cpp
+//
+// With --thumbnails each clip gets small JPEGs of its trigger, peak-score
+// and last frames (STEM-trigger.jpg, STEM-peak.jpg, STEM-last.jpg) and a
+// contact sheet of the three side by side (STEM-sheet.jpg).  The capture
+// thread only copies the frames; scaling, encoding and writing happen on a
+// thumbnail job's thread.  The job also copies the JPEGs to the remote
+// directory itself, and the clip's videos are only queued for copying once
+// it's done, so the thumbnails arrive first.  The clip's event record is
+// completed after the job too, so EVENT_FLAG_THUMBNAILS is only set once all
+// four files have been written.
+static const int THUMBNAIL_WIDTH = 320;
+static const int THUMBNAIL_QUALITY = 80;
+
+// the clip's frames worth a thumbnail
+struct event_keyframes {
+  image    trigger, peak, last;
+  double   peak_score = 0.0;
+  uint64_t peak_seq = 0; // the peak still in the capture ring (0 if copied)
+};
+
+struct thumbnail_job {
+  volatile bool done = false;
+  std::string stem;
+  event_keyframes keyframes;
+  std::string remote_copy_dir; // empty means no remote copies
+  std::vector<std::string> clip_files; // the videos; copied after
+  std::vector<std::string> files;      // the JPEGs written
+  std::string error_message;
+  int64_t      event_offset = -1;      // the clip's record, completed after
+  event_record event;
+
+  std::thread thread;
+
+  thumbnail_job(std::string _stem, event_keyframes &&_keyframes,
+    std::string _remote_copy_dir, std::vector<std::string> _clip_files);
+  void run();
+};
+
+// encoder.cpp
+//
+// Opens the video writer for the next capture in the background so a
+// trigger can start writing frames immediately.
+struct warm_video_writer {
+  std::string       file_name;
+  int               four_cc;
+  double            fps;
+  cv::Size          frame_size;
+
+  cv::VideoWriter   vw;
+  std::atomic<bool> done {false};
+  std::thread       thread;
+
+  warm_video_writer(
+    std::string _file_name, int _four_cc, double _fps, cv::Size _frame_size);
+  void run();
+};
+
 template <typename T,int N>
 struct circular_buffer {
   uint64_t total = 0;
@@ -158,11 +312,14 @@ template <typename T,int N>
 struct numeric_circular_buffer : circular_buffer<T,N>
 {
   double average() const {
+    const int n = (int)std::min<uint64_t>(this->total, N);
+    if (n == 0)
+      return 0.0;
     double sum = 0.0f;
-    for (int i = 0; i < this->total % (N+1); i++) {
+    for (int i = 0; i < n; i++) {
       sum += (double)this->elements[i];
     }
-    return sum / (this->total % (N+1));
+    return sum / n;
   }
   /*
   double tail_average(int last) const {
@@ -181,6 +338,39 @@ struct numeric_circular_buffer : circular_buffer<T,N>
   */
 };
 
+// recording.cpp
+//
+// Adaptive recording (--adaptive-recording) keeps scoring frames while a
+// clip is written (against the background from before the trigger).
+//  * Once the score has been under the threshold for ADAPTIVE_QUIET_S, only
+//    every ADAPTIVE_QUIET_DIVISOR'th frame is new; the frames between repeat
+//    it so the clip keeps real time.  (The writer has a constant frame
+//    rate; an H.264 repeat costs the encoder little and next to no bytes.)
+//    Motion returns the clip to the full rate on the next frame.
+//  * The writer quality follows the score (on backends that support
+//    VIDEOWRITER_PROP_QUALITY).
+//  * --roi-stream also writes a full resolution crop that follows the
+//    motion box (motion#####-roi.mp4).
+// The clip's peak score and its frame go into the event record.
+static const int ADAPTIVE_QUIET_S = 1;
+static const int ADAPTIVE_QUIET_DIVISOR = 6; // e.g. 30 fps -> 5 fps
+static const int ADAPTIVE_MIN_QUALITY = 40;  // at or under the threshold
+static const int ADAPTIVE_MAX_QUALITY = 95;  // at twice the threshold
+static const int ADAPTIVE_ROI_MIN_WIDTH = 160, ADAPTIVE_ROI_MIN_HEIGHT = 120;
+
+struct adaptive_recording {
+  int             quiet_frames = 0;   // consecutive frames under threshold
+  uint64_t        written_seq = 0;    // the frame in the clip's newest slot
+  int             quality = -1;       // the last quality set
+  bool            quality_supported = true;
+  cv::Rect        roi;                // empty without a ROI stream
+  cv::VideoWriter roi_vw;
+
+  uint64_t        frames = 0, new_frames = 0;
+  double          peak_score = 0.0;
+  uint32_t        peak_frame = 0;
+};
+
 template <int N>
 struct time_samples : numeric_circular_buffer<int64_t,N>
 {
@@ -200,8 +390,398 @@ struct time_samples : numeric_circular_buffer<int64_t,N>
   }
 };
 
+// scheduler.cpp
+//
+// Paces the frame loop with absolute deadlines on steady_clock; each
+// deadline is the previous one plus the period, so time spent processing a
+// frame doesn't accumulate as drift.  A frame that finishes after its
+// deadline is late; if we fall a whole period or more behind, the missed
+// deadlines are skipped (counted) rather than rushed through.
+struct frame_scheduler {
+  std::chrono::nanoseconds period {0};
+  time_point               next_deadline;
+
+  uint64_t frames = 0;
+  uint64_t late_frames = 0;
+  uint64_t skipped_frames = 0;
+  // how late sleeps end past their deadline (scheduling jitter)
+  numeric_circular_buffer<int64_t,64> wake_latency_us;
+  int64_t  max_wake_latency_us = 0;
+
+  void start(double fps);
+  // forgets the schedule (e.g. after a deliberate pause)
+  void resync();
+  // accounts for the frame just processed; returns the next deadline
+  time_point advance();
+  // after sleeping until the deadline advance returned
+  void woke();
+
+  double budget_ms() const {return period.count()/1000.0/1000.0;}
+};
+
+// governor.cpp
+//
+// The budget governor watches how much of each frame's budget (the frame
+// period) the capture thread spends working.  Over a window of a second
+// it is overloaded if the busy time passes GOVERNOR_HIGH of the budget or
+// frames run late; then it takes the next step down its ladder
+// (--governor; off unless given).  Once the load stays under GOVERNOR_LOW
+// for the step's restore delay it undoes the last step, but only if the
+// load would stay under GOVERNOR_HIGH without the step's saving (measured
+// over the window after it was taken).  A step taken again within
+// GOVERNOR_RELAPSE_S of being undone doubles its restore delay (from
+// GOVERNOR_RESTORE_S up to GOVERNOR_MAX_RESTORE_S) so a load that sits
+// between the two marks doesn't toggle it forever.
+//   hud          the HUD refreshes at GOVERNOR_HUD_HZ
+//   downscale    detection sees frames GOVERNOR_DETECT_SCALE times smaller
+//   skip-detect  only every other frame is scored
+//   encoder-fps  recordings repeat every other frame (half the new frames)
+enum governor_step {
+  GOVERNOR_HUD = 0,
+  GOVERNOR_DOWNSCALE,
+  GOVERNOR_SKIP_DETECT,
+  GOVERNOR_ENCODER_FPS,
+  GOVERNOR_STEPS
+};
+static const char *const GOVERNOR_STEP_NAMES[GOVERNOR_STEPS] {
+  "hud",
+  "downscale",
+  "skip-detect",
+  "encoder-fps",
+};
+static const double GOVERNOR_HIGH = 0.90;
+static const double GOVERNOR_LOW = 0.60;
+static const double GOVERNOR_LATE_FRACTION = 0.05;
+static const int GOVERNOR_DEGRADE_WINDOWS = 2; // overloaded seconds per step
+static const int GOVERNOR_RESTORE_S = 10;
+static const int GOVERNOR_MAX_RESTORE_S = 640;
+static const int GOVERNOR_RELAPSE_S = 60;
+static const int GOVERNOR_HUD_HZ = 2;
+static const int GOVERNOR_DETECT_SCALE = 2;
+
+struct budget_governor {
+  std::vector<governor_step> ladder;
+  int                        level = 0; // steps of the ladder in effect
+
+  // the current window
+  time_point window_start;
+  int64_t    busy_us = 0, budget_us = 0;
+  uint64_t   frames = 0, late = 0;
+  int        overloaded_windows = 0, idle_windows = 0;
+  double     utilization = 0.0; // of the last window
+  uint64_t   transitions = 0;
+
+  // per step of the ladder
+  std::vector<double> savings;   // utilization after / before it (<= 1)
+  std::vector<int>    restore_s; // its restore delay (backs off)
+  double     utilization_before = 0.0; // of the window before the last step
+  bool       measure_saving = false;   // the last step's first window
+  int        restored_step = -1;       // the step undone last ...
+  time_point restored_at;              // ... and when
+
+  // false (with error) for an unknown step name
+  bool set_ladder(const std::vector<std::string> &names, std::string &error);
+  bool active(governor_step s) const;
+  // accounts for a frame; once a window returns +1 to take the next step,
+  // -1 to undo the last one (and 0 otherwise)
+  int add_frame(int64_t frame_busy_us, double budget_ms, bool frame_late);
+};
+
+// detector.cpp
+//
+// A detector keeps a background model and scores frames against it (higher
+// is more motion).  Scores are only comparable within one detector; the
+// online calibration copes with that, but a --motion-threshold is specific
+// to the detector it was found with.
+//
+//   blur-absdiff     gray, 21x21 blur, block-scored absdiff (the default)
+//   running-average  as above, but quiet frames are blended into the
+//                    background so slow changes (daylight) are absorbed
+//   mog2, knn        OpenCV's background subtractors; the score is the
+//                    mean of the foreground mask (they always learn)
+//   block-hash       per 16x16 block mean luma (an area downscale) compared
+//                    with the background's; no blur and no full-size diff
+struct detector {
+  time_samples<64> cost; // scoring only (microseconds)
+  perf_profiler   *perf = nullptr; // stage counters (if enabled)
+
+  virtual ~detector() { }
+  virtual const char *name() const = 0;
+
+  // restarts the background model from this frame
+  virtual void reset(const image &color_frame) = 0;
+  // a threshold <= 0 asks for an exact score (no early exit)
+  double score(const image &color_frame, double threshold) {
+    cost.start();
+    double s = score_frame(color_frame, threshold);
+    cost.stop();
+    return s;
+  }
+  // the trigger decision for the last scored frame; true if the detector
+  // changed something worth logging (e.g. the activity map)
+  virtual bool learn(bool /* triggered */) {return false;}
+
+  // the difference image (for the HUD)
+  virtual void motion_image(image &dst) const = 0;
+  // where the last frame's motion was (empty if unknown)
+  virtual cv::Rect motion_box() const {return cv::Rect();}
+  // the block scorer (with its activity map) if this detector uses one
+  virtual block_scorer *blocks() {return nullptr;}
+
+protected:
+  virtual double score_frame(const image &color_frame, double threshold) = 0;
+};
+
+// returns nullptr (and sets error) for an unknown name
+std::unique_ptr<detector> create_detector(
+  const std::string &name, std::string &error);
+
+// config.cpp
+//
+// A config file (--config) holds option lines as "key = value" (the
+// command line option without the leading --) with # comments.  Only the
+// keys in RELOADABLE_KEYS are allowed.  The file is applied over the
+// command line at startup and again whenever it changes (or on SIGHUP on
+// POSIX); keys removed from the file keep their last value.
+//
+// A watcher thread notices the change, parses the file and builds
+// anything slow (a new detector and its activity map, remote directories)
+// off the detection thread.  The detection thread takes the result between
+// frames and applies it in one step; a detector it replaces goes back to
+// the watcher, which saves its activity map.
+static const char *const RELOADABLE_KEYS[] {
+  "calibration-mads",
+  "detector",
+  "fps",
+  "max-video-length",
+  "max-videos",
+  "motion-mask-scale",
+  "motion-threshold", // "auto" returns to online calibration
+  "remote-copy",
+};
+
+// applies a config file over os
+bool read_config_file(const std::string &path, opts &os, std::string &error);
+
+struct config_update {
+  opts                      os;
+  std::string               error;        // the file was rejected
+  std::unique_ptr<detector> new_detector; // if os.detector changed
+  std::string               activity_map_note; // how its map was loaded
+  std::vector<std::string>  notes;        // for the detection thread's log
+};
+
+struct config_watcher {
+  std::string                    path;
+  opts                           current; // the watcher's own copy
+  int64_t                        last_write_time;
+
+  std::mutex                     mutex;
+  std::unique_ptr<config_update> pending; // guarded by mutex
+  cv::Size                       frame_size; // guarded by mutex
+  std::unique_ptr<detector>      retired;    // guarded by mutex
+  std::atomic<bool>              has_pending {false};
+  std::atomic<bool>              exit_watcher {false};
+  std::thread                    thread;
+
+  config_watcher(const opts &os);
+  ~config_watcher();
+
+  // the newest update if there is one (detection thread)
+  std::unique_ptr<config_update> take();
+  // the size new detectors' activity maps are loaded for (detection thread)
+  void set_frame_size(cv::Size sz);
+  // a replaced detector whose activity map is to be saved (detection thread)
+  void retire(std::unique_ptr<detector> d);
+
+  // the watcher thread
+  void run();
+  void reload();
+  void load_activity_map(config_update &cu);
+  void save_retired();
+};
+
 static const int MOTION_SAMPLES = 32*8; // about a 8 seconds
 
+// illumination.cpp
+//
+// Switching a light on shifts every pixel, so the global score passes the
+// threshold although nothing moved.  When the detector triggers, the
+// frame and the background are compared at 1/ILLUMINATION_CELL scale:
+// a least squares fit finds the gain and offset mapping the background's
+// luma to the frame's (refit once without the cells the first fit misses)
+// and a cell has changed if it differs by more than ILLUMINATION_CELL_DIFF.
+// It's a lighting change if at least ILLUMINATION_MIN_CHANGED of the cells
+// changed but the fit explains all but ILLUMINATION_MAX_RESIDUAL of them;
+// real motion is local, so it stays changed after the fit (and a small
+// object never changes enough cells to pass for a global change).  Even
+// then, if the cells left over hold a connected cluster of
+// ILLUMINATION_MAX_CLUSTER or more (someone switching on the light and
+// walking in), it's motion.  Saturated cells say little about the gain and
+// are left out of the fit.
+//
+// A lighting change makes the frame the background.  Auto-exposure and
+// ramping lights (fluorescent tubes, dimmers) keep changing for a while, so
+// the frames right after it may trigger again; each is fitted against the
+// newly adopted background and adopted in turn while the fit passes.  Once
+// a run of back to back adoptions lasts ILLUMINATION_SETTLE_S the next
+// trigger is recorded rather than tested again, so a rejection can't keep
+// something that moved in the background.
+static const int ILLUMINATION_CELL = 8;
+static const double ILLUMINATION_CELL_DIFF = 12.0;
+static const double ILLUMINATION_MIN_CHANGED = 0.25;
+static const double ILLUMINATION_MAX_RESIDUAL = 0.03;
+static const int ILLUMINATION_MAX_CLUSTER = 6; // cells (8-connected)
+static const int ILLUMINATION_MIN_LEVEL = 8, ILLUMINATION_MAX_LEVEL = 247;
+static const double ILLUMINATION_SETTLE_S = 3.0;
+
+struct illumination_fit {
+  double gain = 1.0, offset = 0.0;
+  double changed = 0.0;  // fraction of cells changed against the background
+  double residual = 0.0; // ... and after applying the gain and offset
+  int    largest_cluster = 0; // of the cells the fit leaves changed
+  bool   lighting = false;
+};
+
+// both CV_8UC1 and the same (small) size
+illumination_fit fit_illumination(
+  const image &background_luma, const image &frame_luma);
+// a frame's luma downscaled by ILLUMINATION_CELL
+image illumination_luma(const image &color_frame);
+
+// storage.cpp
+//
+// The storage manager keeps local clips within a byte and age budget
+// (--storage-max, --storage-max-age) and keeps --storage-min-free on the
+// volume.  It scans the clip directories once at startup; from then on
+// the capture thread tells it about each clip it finishes and usage is
+// tracked from that alone.  Over budget, it prunes the oldest unpinned
+// clips (down to STORAGE_PRUNE_TARGET of the byte budget so it isn't
+// pruning on every clip).
+//
+// A clip is pinned while it's recorded or copied to the remote directory,
+// or if a STEM.keep file is beside it.  All deletes (pruning and the ones
+// the capture thread used to do itself) happen on the manager's thread.
+static const double STORAGE_PRUNE_TARGET = 0.9;
+static const int STORAGE_CHECK_S = 60; // for age and free space
+
+// motion00042.mp4, motion00042.mask, motion00042-roi.mp4, ...
+struct storage_clip {
+  std::string              stem;   // the path up to the index
+  std::vector<std::string> files;
+  int64_t                  bytes = 0;
+  int64_t                  time_s = 0; // written (seconds since the epoch)
+};
+
+// the clip a file belongs to (its path through the index); "" if none
+std::string storage_clip_stem(const std::string &path);
+// parses e.g. 500M or 20G (powers of 1024); false if malformed
+bool parse_byte_size(const std::string &s, int64_t &bytes);
+// "1.5G" and the like
+std::string format_byte_size(int64_t bytes);
+
+struct storage_manager {
+  const opts                        os;
+
+  std::mutex                        mutex;
+  std::condition_variable           work_ready;
+  std::deque<storage_clip>          clips;     // oldest first
+  std::map<std::string,int>         pinned;    // stem to pin count
+  std::vector<storage_clip>         added;     // not yet stat'ed
+  std::vector<std::string>          deletes;   // requested deletes
+  std::vector<std::string>          messages;  // for the capture thread's log
+  int64_t                           total_bytes = 0;
+  uint64_t                          pruned_clips = 0;
+  int64_t                           pruned_bytes = 0;
+  int                               next_index = 0; // after the last clip
+  bool                              exit_storage = false;
+  std::thread                       thread;
+
+  storage_manager(const opts &_os);
+  ~storage_manager();
+
+  bool has_budget() const {
+    return os.storage_max_bytes > 0 || os.storage_max_age_s > 0.0 ||
+      os.storage_min_free_bytes > 0;
+  }
+  // a finished clip (stem is the video path up to its extension)
+  void add_clip(const std::string &stem, std::vector<std::string> files);
+  void pin(const std::string &stem);
+  void unpin(const std::string &stem);
+  // deletes p (if it's there) on the manager's thread
+  void remove_async(const std::string &p);
+  // what it has to say since the last call
+  std::vector<std::string> take_messages();
+
+  // the manager's thread
+  void run();
+  void scan();
+  void prune();
+  void stat_clip(storage_clip &c);
+};
+
+// hud.cpp
+//
+// The HUD draws and shows its windows on its own thread.  The detection
+// thread publishes snapshots at most HUD_REFRESH_HZ times a second and
+// never waits on the UI; if the UI falls behind, newer images replace older
+// ones (scores accumulate so the graph doesn't lose samples).  The graph
+// only gets exact scores; once calibrated that's every SCORE_EXACT_PERIOD
+// quiet frames (see detecting_motion).
+//
+// HighGUI also delivers keys to the thread that owns the windows, so the
+// HUD thread queues them for the detection thread (see wait_key).
+static const int HUD_REFRESH_HZ = 10;
+static const int HUD_GRAPH_SAMPLES = 300; // one per column pair
+static const int HUD_GRAPH_DX = 2;       // pixels per sample
+
+struct hud_snapshot {
+  bool                enabled = true;
+  image               frame;
+  image               motion;     // the detector's difference image
+  image               background; // non-empty if the background was reset
+  std::vector<double> scores;     // new samples since the last snapshot
+  double              threshold = 0.0;
+  double              video_offset = 0.0;
+};
+
+struct hud_thread {
+  std::mutex              mutex;
+  std::condition_variable snapshot_ready;
+  hud_snapshot            pending;       // guarded by mutex
+  bool                    has_pending = false;
+  std::condition_variable key_ready;
+  std::deque<int>         keys;          // guarded by mutex
+  bool                    exit_hud = false;
+
+  std::atomic<double>     draw_cost_ms {0.0};
+
+  // owned by the HUD thread
+  bool                                            windows_open = false;
+  image                                           stats_window;
+  image                                           graph; // a ring of columns
+  double                                          graph_threshold = 0.0;
+  numeric_circular_buffer<double,HUD_GRAPH_SAMPLES> samples;
+  time_samples<64>                                draw_cost;
+
+  std::thread             thread;
+
+  hud_thread();
+  ~hud_thread();
+
+  // called from the detection thread
+  void publish(hud_snapshot &s);
+  // waits up to ms milliseconds for a key; -1 if none
+  int wait_key(int ms);
+  int wait_key_until(time_point deadline);
+
+  // the HUD thread
+  void run();
+  void draw(const hud_snapshot &s);
+  void draw_graph_column(uint64_t sample_index);
+  void redraw_graph();
+};
+
 // template <IMAGE_TYPE>
 // template <IMAGE_TYPE=cv::umat> for OpenCL?
 struct motion_detector {
@@ -216,29 +796,73 @@ struct motion_detector {
   numeric_circular_buffer<double,MOTION_SAMPLES>     motion_samples;
 
   time_samples<64> motion_cost_estimate;
-  time_samples<64> hud_draw_cost_estimate;
+  time_samples<64> hud_draw_cost_estimate; // publishing (detection thread)
   time_samples<64> frame_overhead_estimate;
+  perf_profiler    perf; // --perf-counters
 
   // pre-buffering so we can see stuff before the motion
+  // (with --frame-bus these images are views of the shared memory)
   circular_buffer<image,PREVIOUS_FRAMES> color_frames;
+  frame_bus_writer frame_bus;
+  uint64_t frame_bus_pending = 0; // a captured frame not yet published
+  int64_t frame_bus_pending_time_us = 0;
 
   time_point startup_time; // for uptime()
   double min_motion_diff = DBL_MAX, max_motion_diff = 0.0f;
 
   // not sure if saving these is helpful; certainly if they pin GPU memory
   // it's less work to thrash new memory
-  image color_to_gray, gray_to_blurred, background_frame_gray_blurred;
-  image absdiff;
-  image stats_window;
-
-  time_point last_capture_time;  // helps us keep track of FPS
+  image background_frame_color;        // for warm start snapshots
+  image background_frame_gray_blurred; // for motion masks and the HUD
+  image background_luma;               // for illumination tests
+  uint64_t lighting_changes = 0;       // triggers rejected as lighting
+  bool lighting_adopted = false; // the last scored frame adopted lighting
+  double lighting_since = 0.0;    // uptime() of the run's first adoption
+  std::unique_ptr<detector> motion_algorithm; // --detector
+  uint64_t early_exits = 0;
+  time_point last_state_save; // activity map and warm start
+
+  frame_scheduler scheduler;
+  time_point      frame_started; // when the current frame's work began
+
+  budget_governor governor;
+  int             detect_scale = 1; // GOVERNOR_DETECT_SCALE when downscaled
+  image           detect_frame;     // the downscaled frame
 
   std::list<copy_thread*> copy_threads; // pending async copies
+  std::list<thumbnail_job*> thumbnail_jobs;
+  thumbnail_job *clip_thumbnail_job = nullptr; // the last clip's (if pending)
+  std::unique_ptr<event_keyframes> keyframes; // of the clip being recorded
+  std::unique_ptr<storage_manager> storage;
+  int first_video_index = 0; // of this run (--max-videos counts from here)
+
+  // the codec found by probe_video_codecs() (-1 if probing failed)
+  int video_fourcc = -1;
+  std::string video_fourcc_name;
+  std::unique_ptr<warm_video_writer> warm_writer;
+
+  event_index_writer event_index;
+  double last_motion_score = 0.0; // adiff_ratio of the last detection
+  bool   last_score_bounded = false; // ... a lower bound (an early exit)
+  // the last clip's peak and flags (for its event record)
+  double   recording_peak_score = 0.0;
+  uint32_t recording_peak_frame = 0;
+  uint32_t recording_flags = 0;
+
+  online_calibrator calibrator;
+
+  score_log_writer score_log;
+  bool background_reset = false;  // SCORE_FLAG_BACKGROUND_RESET
 
   // HUD controls
   bool vidcap_disabled = false;
   bool hud_enabled = true;
 
+  std::unique_ptr<config_watcher> config; // null without --config
+  std::unique_ptr<hud_thread> hud; // null in --headless
+  time_point                  last_hud_publish;
+  hud_snapshot                hud_next; // accumulates the next snapshot
+
   // exit flag
   bool exit_detector = false;
 
@@ -249,21 +873,94 @@ struct motion_detector {
 
   double uptime() const;
   void reset_background(int countdown_s, const char *why);
+  // makes frame the background (without reading a new one)
+  void adopt_background(const image &frame);
 
   void join_finished_asyncs();
+  void log_storage_messages();
   void start_copy_to_remote_async(std::string file_name);
 
   const image &capture_frame(cv::VideoWriter *vw = nullptr);
 
-  void calibrate_motion_threshold();
-
 
   bool detecting_motion();
 
-  void draw_hud(double video_offset = 0.0);
-
-  void capture_video(const char *why);
-  void capture_video_body(std::string file_name);
+  void publish_hud(double video_offset = 0.0);
+  int wait_key(int ms);
+  // sleeps until the next frame deadline (processing keys); returns the key
+  int wait_next_frame();
+
+  void load_activity_map();
+  void save_activity_map();
+
+  // applies a config reload (between frames)
+  void apply_config(config_update &cu);
+
+  // governor.cpp
+  void update_governor(int64_t frame_busy_us, bool frame_late);
+  // switches the detection scale if the governor changed it
+  void sync_detect_scale();
+  // the frame the detector sees (newest or a downscaled copy)
+  const image &detection_frame(const image &color_frame);
+  // the detector's motion box in frame coordinates
+  cv::Rect motion_box() const;
+
+  void open_frame_bus();
+  // publishes the last captured frame to the frame bus (if any)
+  void publish_frame(double score, uint32_t flags);
+
+  // illumination.cpp
+  // true if the trigger was a lighting change (the background follows it)
+  bool rejected_as_lighting(double score);
+
+  // thumbnails.cpp
+  // the trigger frame (the newest) starts the clip's keyframes
+  void start_keyframes();
+  // notes a scored frame of the clip (a candidate for the peak)
+  void track_keyframes(double score);
+  // the newest frame ends it; returns the keyframes
+  event_keyframes finish_keyframes();
+  // writes the thumbnails; the clip's files are added and copied after
+  void start_thumbnail_job(
+    const std::string &stem, std::vector<std::string> clip_files);
+  void finish_thumbnail_job(thumbnail_job *tj);
+
+  // warmstart.cpp
+  bool load_warm_start();
+  void save_warm_start();
+
+  // returns the video index or -1 if nothing was captured
+  int capture_video(const char *why);
+  void capture_video_body(
+    cv::VideoWriter &vw,
+    std::string file_name,
+    std::string mask_file_name,
+    std::string roi_file_name,
+    time_point trigger_time,
+    bool warm);
+
+  // recording.cpp
+  void start_adaptive_recording(
+    adaptive_recording &ar, const std::string &roi_file_name);
+  // scores and writes the newest frame; returns its score
+  double write_adaptive_frame(adaptive_recording &ar, cv::VideoWriter &vw);
+  // repeats the clip's last frame (for a missed deadline)
+  void repeat_adaptive_frame(adaptive_recording &ar, cv::VideoWriter &vw);
+  void finish_adaptive_recording(
+    adaptive_recording &ar, const std::string &file_name);
+
+  // encoder.cpp
+  std::string video_file_stem(int video_index) const;
+  void probe_video_codecs();
+  bool open_video_writer(cv::VideoWriter &vw, const std::string &file_name,
+    cv::Size frame_size);
+  void prepare_warm_writer();
+  void discard_warm_writer();
+
+  // appends the trigger's record; returns its offset (-1 if none)
+  int64_t begin_event(int64_t time_us);
+  // completes it with the clip's details
+  void record_event(int64_t offset, int64_t time_us, int video_index);
 
   void run();
   void process_key(int key);
@@ -0,0 +1,182 @@
+#include "motionmask.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+void motion_mask_writer::open(
+  const std::string &path,
+  const cv::Mat &background,
+  cv::Size frame_size,
+  int scale,
+  double fps,
+  std::string &error)
+{
+  cv::Size mask_size(
+    std::max(1, frame_size.width/scale),
+    std::max(1, frame_size.height/scale));
+  if ((mask_size.area() + 7)/8 > UINT16_MAX) {
+    // frame payload lengths are 16 bits
+    error = "motion mask too large (increase the mask scale)";
+    return;
+  }
+  cv::resize(background, background_small, mask_size, 0, 0, cv::INTER_AREA);
+
+  stream.open(path, std::ios::binary | std::ios::trunc);
+  if (!stream.is_open()) {
+    error = "failed to open motion mask file";
+    return;
+  }
+  motion_mask_header mmh;
+  memcpy(mmh.magic, MOTION_MASK_MAGIC, sizeof(mmh.magic));
+  mmh.version = MOTION_MASK_VERSION;
+  mmh.width = (uint16_t)mask_size.width;
+  mmh.height = (uint16_t)mask_size.height;
+  mmh.frame_width = (uint16_t)frame_size.width;
+  mmh.frame_height = (uint16_t)frame_size.height;
+  mmh.fps = (float)fps;
+  stream.write((const char *)&mmh, sizeof(mmh));
+  bytes_written = sizeof(mmh);
+}
+
+void motion_mask_writer::add(const cv::Mat &color_frame)
+{
+  if (!stream.is_open())
+    return;
+
+  // shrinking first makes the color conversion nearly free and INTER_AREA
+  // stands in for the detector's blur
+  cv::resize(color_frame, frame_small, background_small.size(),
+    0, 0, cv::INTER_AREA);
+  cv::cvtColor(frame_small, gray_small, cv::COLOR_BGR2GRAY);
+  cv::absdiff(gray_small, background_small, diff_small);
+
+  const int cells = diff_small.rows*diff_small.cols;
+
+  // run-length encode
+  payload.clear();
+  bool set = false;
+  int run = 0;
+  auto emit_run = [&] () {
+    while (run > 255) {
+      payload.push_back(255);
+      payload.push_back(0);
+      run -= 255;
+    }
+    payload.push_back((uint8_t)run);
+  };
+  for (int y = 0; y < diff_small.rows; y++) {
+    const uint8_t *row = diff_small.ptr<uint8_t>(y);
+    for (int x = 0; x < diff_small.cols; x++) {
+      bool cell = row[x] > MOTION_MASK_PIXEL_THRESHOLD;
+      if (cell != set) {
+        emit_run();
+        set = cell;
+        run = 0;
+      }
+      run++;
+    }
+  }
+  emit_run();
+
+  encoding = MOTION_MASK_RLE;
+  if (payload.size() > (size_t)(cells + 7)/8) {
+    // busy frame; bit-packing is smaller
+    encoding = MOTION_MASK_BITS;
+    payload.assign((cells + 7)/8, 0);
+    int i = 0;
+    for (int y = 0; y < diff_small.rows; y++) {
+      const uint8_t *row = diff_small.ptr<uint8_t>(y);
+      for (int x = 0; x < diff_small.cols; x++, i++) {
+        if (row[x] > MOTION_MASK_PIXEL_THRESHOLD)
+          payload[i/8] |= (uint8_t)(1 << (i % 8));
+      }
+    }
+  }
+
+  repeat_last();
+}
+
+void motion_mask_writer::repeat_last()
+{
+  if (!stream.is_open())
+    return;
+  uint8_t hdr[3] = {
+    encoding,
+    (uint8_t)(payload.size() & 0xFF),
+    (uint8_t)(payload.size() >> 8),
+  };
+  stream.write((const char *)hdr, sizeof(hdr));
+  stream.write((const char *)payload.data(), payload.size());
+  bytes_written += sizeof(hdr) + payload.size();
+}
+
+void motion_mask_writer::close()
+{
+  if (stream.is_open())
+    stream.close();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool read_motion_masks(
+  const std::string &path,
+  motion_mask_header &mmh,
+  std::vector<cv::Mat> &masks,
+  std::string &error)
+{
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs) {
+    error = "failed to open motion mask file";
+    return false;
+  }
+  if (!ifs.read((char *)&mmh, sizeof(mmh)) ||
+    memcmp(mmh.magic, MOTION_MASK_MAGIC, sizeof(mmh.magic)) != 0)
+  {
+    error = "not a motion mask file (bad magic)";
+    return false;
+  } else if (mmh.version != MOTION_MASK_VERSION) {
+    error = "unsupported motion mask version";
+    return false;
+  }
+
+  const int cells = mmh.width*mmh.height;
+  std::vector<uint8_t> payload;
+  while (true) {
+    uint8_t hdr[3];
+    if (!ifs.read((char *)hdr, sizeof(hdr)))
+      break; // end of file (or a torn frame)
+    payload.resize(hdr[1] | (hdr[2] << 8));
+    if (!ifs.read((char *)payload.data(), payload.size()))
+      break;
+
+    cv::Mat mask = cv::Mat::zeros(mmh.height, mmh.width, CV_8UC1);
+    uint8_t *cell = mask.ptr<uint8_t>(0);
+    if (hdr[0] == MOTION_MASK_RLE) {
+      int i = 0;
+      bool set = false;
+      for (uint8_t run : payload) {
+        if (i + run > cells) {
+          error = "malformed run length";
+          return false;
+        }
+        if (set)
+          memset(cell + i, 0xFF, run);
+        i += run;
+        set = !set;
+      }
+    } else if (hdr[0] == MOTION_MASK_BITS) {
+      if ((int)payload.size() * 8 < cells) {
+        error = "truncated bit-packed mask";
+        return false;
+      }
+      for (int i = 0; i < cells; i++) {
+        if (payload[i/8] & (1 << (i % 8)))
+          cell[i] = 0xFF;
+      }
+    } else {
+      error = "unknown mask encoding";
+      return false;
+    }
+    masks.push_back(mask);
+  }
+  return true;
+}
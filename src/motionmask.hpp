@@ -0,0 +1,76 @@
+#ifndef MOTIONMASK_HPP
+#define MOTIONMASK_HPP
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// A motion mask file (motion#####.mask) sits next to each captured video.
+// It holds a downsampled, thresholded absdiff mask for every written frame
+// so a viewer can overlay where the motion was without a second video.
+//
+//   motion_mask_header
+//   per frame:
+//     uint8_t  encoding   // MOTION_MASK_*
+//     uint16_t length     // payload bytes (little endian)
+//     uint8_t  payload[length]
+//
+// MOTION_MASK_RLE payloads are alternating run lengths of clear and set
+// cells in row-major order starting with a clear run; a run longer than 255
+// is split as 255, 0, ... (a zero-length run of the opposite value).
+// MOTION_MASK_BITS payloads are the cells bit-packed LSB first.  The writer
+// picks whichever is smaller for each frame.
+
+static const char MOTION_MASK_MAGIC[8] = {'M','D','M','A','S','K','\0','\0'};
+static const uint32_t MOTION_MASK_VERSION = 1;
+
+static const uint8_t MOTION_MASK_RLE = 0;
+static const uint8_t MOTION_MASK_BITS = 1;
+
+// pixel difference (0..255) for a cell to count as moving
+static const int MOTION_MASK_PIXEL_THRESHOLD = 16;
+
+struct motion_mask_header {
+  char     magic[8];
+  uint32_t version;
+  uint16_t width, height;      // mask cells
+  uint16_t frame_width, frame_height;
+  float    fps;
+};
+static_assert(sizeof(motion_mask_header) == 24, "unexpected header size");
+
+struct motion_mask_writer {
+  std::ofstream        stream;
+  cv::Mat              background_small;
+  cv::Mat              frame_small, gray_small, diff_small;
+  std::vector<uint8_t> payload;
+  uint8_t              encoding = MOTION_MASK_RLE;
+  uint64_t             bytes_written = 0;
+
+  // background is the (full resolution) gray background the detector uses
+  void open(
+    const std::string &path,
+    const cv::Mat &background,
+    cv::Size frame_size,
+    int scale,
+    double fps,
+    std::string &error);
+  bool is_open() const {return stream.is_open();}
+  void add(const cv::Mat &color_frame);
+  // repeats the last frame's mask (for a frame written twice)
+  void repeat_last();
+  void close();
+};
+
+// decodes an entire mask file (one CV_8UC1 0/255 image per frame);
+// returns false and sets error on a malformed file
+bool read_motion_masks(
+  const std::string &path,
+  motion_mask_header &mmh,
+  std::vector<cv::Mat> &masks,
+  std::string &error);
+
+#endif
@@ -0,0 +1,202 @@
+#include "perfcounters.hpp"
+
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+// glibc has no wrapper
+static int perf_event_open(perf_event_attr *attr, int group_fd) {
+  // this thread (pid 0) on any cpu (-1)
+  return (int)syscall(SYS_perf_event_open, attr, 0, -1, group_fd,
+    PERF_FLAG_FD_CLOEXEC);
+}
+
+static std::string open_error(int err) {
+  switch (err) {
+  case EACCES:
+  case EPERM:
+    return "not permitted (see /proc/sys/kernel/perf_event_paranoid)";
+  case ENOENT:
+  case ENODEV:
+  case EOPNOTSUPP:
+    return "no such hardware counter (a VM without a PMU?)";
+  case ENOSYS:
+    return "perf_event_open unsupported (a container or old kernel?)";
+  default:
+    return std::strerror(err);
+  }
+}
+
+bool perf_counters::open(std::string &error)
+{
+  close();
+  static const uint64_t CONFIGS[] {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+  };
+  int *const indices[] {&cycles_index, &instructions_index, &cache_misses_index};
+  int first_errno = 0;
+  for (int i = 0; i < 3; i++) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = CONFIGS[i];
+    attr.read_format = PERF_FORMAT_GROUP |
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.disabled = leader_fd < 0 ? 1 : 0; // the group starts with its leader
+    int fd = perf_event_open(&attr, leader_fd);
+    if (fd < 0) {
+      // a missing event still leaves the others
+      if (!first_errno)
+        first_errno = errno;
+      continue;
+    }
+    if (leader_fd < 0)
+      leader_fd = fd;
+    fds[hardware_counters] = fd;
+    *indices[i] = hardware_counters++;
+  }
+  if (leader_fd < 0) {
+    error = open_error(first_errno);
+    return false;
+  }
+  ioctl(leader_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  if (hardware_counters < 3)
+    error = "some counters unavailable: " + open_error(first_errno);
+  return true;
+}
+
+void perf_counters::close()
+{
+  for (int &fd : fds) {
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+  leader_fd = -1;
+  hardware_counters = 0;
+  cycles_index = instructions_index = cache_misses_index = -1;
+}
+
+void perf_counters::read(perf_sample &s) const
+{
+  s.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  struct rusage ru;
+  if (getrusage(RUSAGE_THREAD, &ru) == 0)
+    s.context_switches = (uint64_t)(ru.ru_nvcsw + ru.ru_nivcsw);
+  if (leader_fd < 0)
+    return;
+
+  // PERF_FORMAT_GROUP: nr, time enabled, time running, values[nr]
+  uint64_t buf[3 + 3];
+  if (::read(leader_fd, buf, sizeof(buf)) < (ssize_t)(3*sizeof(uint64_t)))
+    return;
+  const uint64_t nr = buf[0], enabled = buf[1], running = buf[2];
+  // when the PMU is shared the group only counts part of the time
+  auto value = [&] (int index) -> uint64_t {
+    if (index < 0 || (uint64_t)index >= nr || running == 0)
+      return 0;
+    return running < enabled ?
+      (uint64_t)((double)buf[3 + index]*enabled/running) : buf[3 + index];
+  };
+  s.cycles = value(cycles_index);
+  s.instructions = value(instructions_index);
+  s.cache_misses = value(cache_misses_index);
+}
+
+#else // !__linux__
+
+bool perf_counters::open(std::string &error)
+{
+  error = "hardware counters are only supported on Linux";
+  return false;
+}
+
+void perf_counters::close() { }
+
+void perf_counters::read(perf_sample &s) const
+{
+  s.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif // !__linux__
+
+bool perf_profiler::open(std::string &error)
+{
+  enabled = true;
+  stages = std::array<perf_stage_stats,PERF_STAGES>();
+  return counters.open(error) && error.empty();
+}
+
+void perf_profiler::add(
+  perf_stage s, const perf_sample &start, const perf_sample &end)
+{
+  perf_stage_stats &ss = stages[s];
+  ss.samples++;
+  ss.total.time_ns += end.time_ns - start.time_ns;
+  ss.total.cycles += end.cycles - start.cycles;
+  ss.total.instructions += end.instructions - start.instructions;
+  ss.total.cache_misses += end.cache_misses - start.cache_misses;
+  ss.total.context_switches += end.context_switches - start.context_switches;
+}
+
+void perf_profiler::report(std::ostream &os) const
+{
+  std::stringstream ss;
+  ss << std::fixed;
+  ss << "  stage      samples  ms/sample  Mcycles    IPC  misses/kinst"
+    "  ctx sw/sample\n";
+  for (int i = 0; i < PERF_STAGES; i++) {
+    const perf_stage_stats &st = stages[i];
+    ss << "  " << std::left << std::setw(8) << PERF_STAGE_NAMES[i] <<
+      std::right << std::setw(10) << st.samples;
+    if (st.samples == 0) {
+      ss << "\n";
+      continue;
+    }
+    const double n = (double)st.samples;
+    ss << std::setw(11) << std::setprecision(3) <<
+      st.total.time_ns/n/1000.0/1000.0;
+    if (counters.has_cycles())
+      ss << std::setw(9) << std::setprecision(3) << st.total.cycles/n/1e6;
+    else
+      ss << std::setw(9) << "n/a";
+    if (counters.has_cycles() && counters.has_instructions() &&
+      st.total.cycles > 0)
+    {
+      ss << std::setw(7) << std::setprecision(2) <<
+        (double)st.total.instructions/st.total.cycles;
+    } else {
+      ss << std::setw(7) << "n/a";
+    }
+    if (counters.has_instructions() && counters.has_cache_misses() &&
+      st.total.instructions > 0)
+    {
+      ss << std::setw(14) << std::setprecision(2) <<
+        1000.0*st.total.cache_misses/st.total.instructions;
+    } else {
+      ss << std::setw(14) << "n/a";
+    }
+    ss << std::setw(15) << std::setprecision(3) <<
+      st.total.context_switches/n << "\n";
+  }
+  os << ss.str();
+}
@@ -0,0 +1,113 @@
+#ifndef PERFCOUNTERS_HPP
+#define PERFCOUNTERS_HPP
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Hardware counters per pipeline stage (--perf-counters).  Wall clock times
+// can't say whether a stage is compute bound (high instructions per cycle)
+// or waiting on memory (cache misses); these can.
+//
+// On Linux the counters come from perf_event_open(2): one group (cycles,
+// instructions, cache misses) for the detection thread, counting user mode
+// only so the default perf_event_paranoid (2) allows it.  Context switches
+// come from getrusage(RUSAGE_THREAD) since the software event needs kernel
+// counting.  Counters that can't be opened (containers, a stricter
+// perf_event_paranoid, VMs without a PMU, other platforms) are reported as
+// unavailable; stage times are still measured.
+//
+// Stages don't nest; encoding is the video write inside the capture.  The
+// HUD stage is publishing on the detection thread (drawing has its own
+// thread).
+enum perf_stage {
+  PERF_CAPTURE = 0,
+  PERF_CONVERT,
+  PERF_BLUR,
+  PERF_DIFF,   // diff and reduction to a score
+  PERF_HUD,
+  PERF_ENCODE,
+  PERF_STAGES
+};
+static const char *const PERF_STAGE_NAMES[PERF_STAGES] {
+  "capture",
+  "convert",
+  "blur",
+  "diff",
+  "hud",
+  "encode",
+};
+
+struct perf_sample {
+  int64_t  time_ns = 0;
+  uint64_t cycles = 0, instructions = 0, cache_misses = 0;
+  uint64_t context_switches = 0;
+};
+
+// the counters of the thread that opened them
+struct perf_counters {
+  perf_counters() { }
+  perf_counters(const perf_counters &) = delete;
+  perf_counters &operator=(const perf_counters &) = delete;
+  ~perf_counters() {close();}
+
+  // false (with the reason) if no hardware counter could be opened
+  bool open(std::string &error);
+  void close();
+  bool has_hardware() const {return hardware_counters > 0;}
+  bool has_cycles() const {return cycles_index >= 0;}
+  bool has_instructions() const {return instructions_index >= 0;}
+  bool has_cache_misses() const {return cache_misses_index >= 0;}
+
+  // (on the opening thread) the counts so far
+  void read(perf_sample &s) const;
+
+private:
+  int leader_fd = -1;
+  int fds[3] {-1, -1, -1};
+  int hardware_counters = 0;
+  int cycles_index = -1, instructions_index = -1, cache_misses_index = -1;
+};
+
+struct perf_stage_stats {
+  uint64_t    samples = 0;
+  perf_sample total;
+};
+
+struct perf_profiler {
+  bool                                       enabled = false;
+  perf_counters                              counters;
+  std::array<perf_stage_stats,PERF_STAGES>   stages;
+
+  // enables the profiler; false (with a reason) if it runs with times only
+  bool open(std::string &error);
+
+  void add(perf_stage s, const perf_sample &start, const perf_sample &end);
+  // a table of per-sample averages
+  void report(std::ostream &os) const;
+};
+
+// measures a stage for the rest of the scope (a null or disabled profiler
+// does nothing)
+struct perf_scope {
+  perf_profiler *profiler;
+  perf_stage     stage;
+  perf_sample    start;
+
+  perf_scope(perf_profiler *p, perf_stage s)
+    : profiler(p && p->enabled ? p : nullptr), stage(s)
+  {
+    if (profiler)
+      profiler->counters.read(start);
+  }
+  ~perf_scope() {
+    if (profiler) {
+      perf_sample end;
+      profiler->counters.read(end);
+      profiler->add(stage, start, end);
+    }
+  }
+};
+
+#endif
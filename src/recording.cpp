@@ -0,0 +1,127 @@
+#include "mdet.hpp"
+#include "fs.hpp"
+
+// a size rectangle centered on box (as far as the frame allows)
+static cv::Rect roi_around(const cv::Rect &box, cv::Size frame, cv::Size size)
+{
+  const int x = box.x + box.width/2 - size.width/2;
+  const int y = box.y + box.height/2 - size.height/2;
+  return cv::Rect(
+    std::max(0, std::min(x, frame.width - size.width)),
+    std::max(0, std::min(y, frame.height - size.height)),
+    size.width, size.height);
+}
+
+void motion_detector::start_adaptive_recording(
+  adaptive_recording &ar, const std::string &roi_file_name)
+{
+  ar.written_seq = color_frames.total;
+  if (roi_file_name.empty())
+    return;
+  const cv::Size frame = color_frames.newest().size();
+  const cv::Rect box = motion_box();
+  if (box.empty()) {
+    log(roi_file_name,": no motion box (no ROI stream)");
+    return;
+  }
+  // twice the trigger's box leaves room to follow it; the size is fixed
+  // for the clip since the writer needs one frame size
+  cv::Size size(
+    std::min(frame.width, std::max(2*box.width, ADAPTIVE_ROI_MIN_WIDTH)),
+    std::min(frame.height, std::max(2*box.height, ADAPTIVE_ROI_MIN_HEIGHT)));
+  size.width &= ~1;
+  size.height &= ~1;
+  if (size == frame) {
+    log(roi_file_name,": motion covers the frame (no ROI stream)");
+    return;
+  }
+  if (!open_video_writer(ar.roi_vw, roi_file_name, size)) {
+    log(roi_file_name,": ERROR: failed to open the ROI video writer");
+    return;
+  }
+  // the point of the crop is detail
+  ar.roi_vw.set(cv::VIDEOWRITER_PROP_QUALITY, ADAPTIVE_MAX_QUALITY);
+  ar.roi = roi_around(box, frame, size);
+  recording_flags |= EVENT_FLAG_ROI_VIDEO;
+  log(roi_file_name,": ",size.width,"x",size.height," ROI stream at (",
+    ar.roi.x,",",ar.roi.y,")");
+}
+
+double motion_detector::write_adaptive_frame(
+  adaptive_recording &ar, cv::VideoWriter &vw)
+{
+  const image &frame = color_frames.newest();
+  // exact: the peak (and its frame) goes into the event record, the
+  // score is published and the ROI follows the box
+  const double score = motion_algorithm->score(detection_frame(frame), 0.0);
+  if (hud)
+    hud_next.scores.push_back(score);
+  if (score > ar.peak_score) {
+    ar.peak_score = score;
+    ar.peak_frame = (uint32_t)ar.frames;
+  }
+
+  const int quiet_after = std::max(1, (int)(ADAPTIVE_QUIET_S*os.fps));
+  ar.quiet_frames = score > motion_threshold ? 0 : ar.quiet_frames + 1;
+  const bool quiet = ar.quiet_frames > quiet_after;
+  // while quiet only every ADAPTIVE_QUIET_DIVISOR'th frame is new (and
+  // only every other one under the governor's encoder-fps step)
+  const bool halved = governor.active(GOVERNOR_ENCODER_FPS);
+  if (quiet ?
+    (ar.quiet_frames - quiet_after) % ADAPTIVE_QUIET_DIVISOR == 1 :
+    !halved || color_frames.total % 2 == 0)
+  {
+    ar.written_seq = color_frames.total;
+    ar.new_frames++;
+  }
+
+  if (ar.quality_supported) {
+    double t = motion_threshold > 0.0 ? score/motion_threshold - 1.0 : 1.0;
+    t = std::max(0.0, std::min(1.0, t));
+    int quality = ADAPTIVE_MIN_QUALITY +
+      (int)(t*(ADAPTIVE_MAX_QUALITY - ADAPTIVE_MIN_QUALITY));
+    // small steps aren't worth a property change
+    if (ar.quality < 0 || std::abs(quality - ar.quality) >= 5) {
+      if (vw.set(cv::VIDEOWRITER_PROP_QUALITY, quality)) {
+        ar.quality = quality;
+      } else {
+        log("video writer has no quality setting (constant quality)");
+        ar.quality_supported = false;
+      }
+    }
+  }
+
+  if (!ar.roi.empty()) {
+    const cv::Rect box = motion_box();
+    if (!box.empty())
+      ar.roi = roi_around(box, frame.size(), ar.roi.size());
+  }
+
+  repeat_adaptive_frame(ar, vw);
+  return score;
+}
+
+void motion_detector::repeat_adaptive_frame(
+  adaptive_recording &ar, cv::VideoWriter &vw)
+{
+  // written_seq is at most ADAPTIVE_QUIET_DIVISOR frames back in the ring
+  const image &frame =
+    color_frames.elements[(ar.written_seq - 1) % PREVIOUS_FRAMES];
+  perf_scope ps(&perf, PERF_ENCODE);
+  vw.write(frame);
+  if (!ar.roi.empty())
+    ar.roi_vw.write(frame(ar.roi));
+  ar.frames++;
+}
+
+void motion_detector::finish_adaptive_recording(
+  adaptive_recording &ar, const std::string &file_name)
+{
+  if (ar.roi_vw.isOpened())
+    ar.roi_vw.release();
+  recording_peak_score = ar.peak_score;
+  recording_peak_frame = ar.peak_frame;
+  log(file_name,": ",ar.new_frames," of ",ar.frames,
+    " frames new (the rest repeated while quiet); peak score ",
+    format(ar.peak_score,0,3)," at frame ",ar.peak_frame);
+}
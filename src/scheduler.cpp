@@ -0,0 +1,34 @@
+#include "mdet.hpp"
+
+void frame_scheduler::start(double fps) {
+  period = std::chrono::nanoseconds((int64_t)(1000.0*1000.0*1000.0/fps));
+  resync();
+}
+
+void frame_scheduler::resync() {
+  next_deadline = now();
+}
+
+time_point frame_scheduler::advance() {
+  frames++;
+  next_deadline += period;
+  auto t = now();
+  if (t > next_deadline) {
+    late_frames++;
+    auto missed = (t - next_deadline)/period;
+    if (missed > 0) {
+      skipped_frames += missed;
+      next_deadline += missed*period;
+    }
+  }
+  return next_deadline;
+}
+
+void frame_scheduler::woke() {
+  auto late = std::chrono::duration_cast<std::chrono::microseconds>(
+    now() - next_deadline).count();
+  if (late < 0)
+    return;
+  wake_latency_us.add(late);
+  max_wake_latency_us = std::max(max_wake_latency_us, (int64_t)late);
+}
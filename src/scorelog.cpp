@@ -0,0 +1,268 @@
+#include "scorelog.hpp"
+#include "calibrator.hpp"
+#include "events.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+// the length of the whole blocks (and header) at the front of the log
+static uint64_t whole_score_log_size(const std::string &path, uint64_t size)
+{
+  std::ifstream is(path, std::ios::binary);
+  score_log_header slh;
+  if (!is.read((char *)&slh, sizeof(slh)))
+    return 0;
+  uint64_t off = sizeof(slh);
+  score_log_block_header slbh;
+  while (is.seekg((std::streamoff)off) &&
+    is.read((char *)&slbh, sizeof(slbh)))
+  {
+    const uint64_t end =
+      off + sizeof(slbh) + score_log_block_body_size(slbh.count);
+    if (slbh.count == 0 || slbh.count > SCORE_LOG_BLOCK_FRAMES || end > size)
+      break;
+    off = end;
+  }
+  return off;
+}
+
+void score_log_writer::open(const std::string &path, std::string &error)
+{
+  // a killed process leaves a torn block; appending after it would hide
+  // every later block from readers, so cut it off
+  const int64_t size = fs::file_size(path);
+  if (size > 0) {
+    const uint64_t whole = whole_score_log_size(path, (uint64_t)size);
+    if (whole != (uint64_t)size) {
+      fs::resize_file(path, whole, error);
+      if (!error.empty())
+        return;
+    }
+  }
+  stream.open(path, std::ios::binary | std::ios::app);
+  if (!stream.is_open()) {
+    error = "failed to open score log";
+    return;
+  }
+  stream.seekp(0, std::ios::end);
+  if (stream.tellp() == std::streampos(0)) {
+    score_log_header slh;
+    memcpy(slh.magic, SCORE_LOG_MAGIC, sizeof(slh.magic));
+    slh.version = SCORE_LOG_VERSION;
+    slh.reserved = 0;
+    stream.write((const char *)&slh, sizeof(slh));
+  }
+  dt_us.reserve(SCORE_LOG_BLOCK_FRAMES);
+  scores.reserve(SCORE_LOG_BLOCK_FRAMES);
+  flags.reserve(SCORE_LOG_BLOCK_FRAMES);
+}
+
+void score_log_writer::add(int64_t time_us, double score, uint8_t fs)
+{
+  if (!stream.is_open())
+    return;
+  // a block must fit its time offsets into 32 bits (about 71 minutes);
+  // and a kill shouldn't lose more than SCORE_LOG_FLUSH_S
+  if (!dt_us.empty() &&
+    time_us - base_time_us >= SCORE_LOG_FLUSH_S*1000LL*1000LL)
+  {
+    flush();
+  }
+  if (dt_us.empty())
+    base_time_us = time_us;
+  dt_us.push_back((uint32_t)(time_us - base_time_us));
+  scores.push_back((float)score);
+  flags.push_back(fs);
+  if (dt_us.size() == SCORE_LOG_BLOCK_FRAMES)
+    flush();
+}
+
+void score_log_writer::flush()
+{
+  if (!stream.is_open() || dt_us.empty())
+    return;
+  score_log_block_header slbh;
+  slbh.base_time_us = base_time_us;
+  slbh.count = (uint32_t)dt_us.size();
+  slbh.reserved = 0;
+  stream.write((const char *)&slbh, sizeof(slbh));
+  stream.write((const char *)dt_us.data(), dt_us.size()*sizeof(dt_us[0]));
+  stream.write((const char *)scores.data(), scores.size()*sizeof(scores[0]));
+  stream.write((const char *)flags.data(), flags.size()*sizeof(flags[0]));
+  static const char PADDING[8] { };
+  size_t unpadded = dt_us.size()*(sizeof(uint32_t) + sizeof(float) + 1);
+  stream.write(PADDING, score_log_block_body_size(slbh.count) - unpadded);
+  stream.flush();
+  dt_us.clear();
+  scores.clear();
+  flags.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool score_log_reader::open(const std::string &path, std::string &error)
+{
+  if (!file.open(path, error))
+    return false;
+  if (file.size < sizeof(score_log_header)) {
+    error = "truncated score log header";
+    return false;
+  }
+  const auto *slh = (const score_log_header *)file.data;
+  if (memcmp(slh->magic, SCORE_LOG_MAGIC, sizeof(slh->magic)) != 0) {
+    error = "not a score log (bad magic)";
+    return false;
+  } else if (slh->version != SCORE_LOG_VERSION) {
+    error = "unsupported score log version";
+    return false;
+  }
+
+  size_t off = sizeof(score_log_header);
+  while (off + sizeof(score_log_block_header) <= file.size) {
+    score_log_block_header slbh;
+    memcpy(&slbh, file.data + off, sizeof(slbh));
+    size_t body = score_log_block_body_size(slbh.count);
+    if (slbh.count == 0 ||
+      off + sizeof(slbh) + body > file.size)
+    {
+      break; // torn block
+    }
+    const uint8_t *cols = file.data + off + sizeof(slbh);
+    score_log_block b;
+    b.base_time_us = slbh.base_time_us;
+    b.count = slbh.count;
+    b.dt_us = (const uint32_t *)cols;
+    b.scores = (const float *)(cols + slbh.count*sizeof(uint32_t));
+    b.flags = cols + slbh.count*(sizeof(uint32_t) + sizeof(float));
+    blocks.push_back(b);
+    total_frames += slbh.count;
+    off += sizeof(slbh) + body;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int run_score_replay(const replay_options &ro)
+{
+  auto replay_started = std::chrono::steady_clock::now();
+
+  score_log_reader slr;
+  std::string error;
+  if (!slr.open(ro.path, error)) {
+    std::cerr << ro.path << ": " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  std::stringstream ss;
+  double threshold = ro.threshold;
+  const int64_t holdoff_us = (int64_t)(ro.holdoff_s*1000.0*1000.0);
+  int64_t holdoff_until = INT64_MIN;
+  bool armed = true;
+  int frames_over = 0;
+
+  const bool calibrate = ro.threshold <= 0.0;
+  online_calibrator calibrator;
+  calibrator.mad_units = ro.calibration_mad_units;
+  uint64_t adjustments = 0;
+  auto add_quiet_score = [&] (int64_t t, double score, uint8_t flags) {
+    if (!calibrate || (flags & SCORE_FLAG_BOUNDED) || !calibrator.add(score))
+      return;
+    threshold = calibrator.threshold;
+    adjustments++;
+    if (ro.list_triggers) {
+      ss << format_event_time(t) << "  adjusted threshold to " <<
+        std::fixed << std::setprecision(3) << threshold << "\n";
+    }
+  };
+
+  uint64_t live_triggers = 0, replay_triggers = 0, matched_triggers = 0;
+  int64_t first_time_us = 0, last_time_us = 0;
+  for (const score_log_block &b : slr.blocks) {
+    for (uint32_t i = 0; i < b.count; i++) {
+      const int64_t t = b.base_time_us + b.dt_us[i];
+      const double score = b.scores[i];
+      const uint8_t flags = b.flags[i];
+      if (first_time_us == 0)
+        first_time_us = t;
+      last_time_us = t;
+
+      if (threshold <= 0.0) {
+        add_quiet_score(t, score, flags);
+        continue; // not calibrated yet
+      }
+
+      const bool live_triggered = (flags & SCORE_FLAG_TRIGGERED) != 0;
+      if (live_triggered)
+        live_triggers++;
+      // the live detector saw a lighting change; no threshold records it
+      if (flags & SCORE_FLAG_LIGHTING)
+        continue;
+
+      if (t < holdoff_until)
+        continue;
+      if (!armed) {
+        if (score >= ro.hysteresis*threshold)
+          continue;
+        armed = true;
+      }
+      if (score <= threshold) {
+        frames_over = 0;
+        add_quiet_score(t, score, flags);
+        continue;
+      }
+      if (++frames_over < ro.min_frames)
+        continue;
+
+      replay_triggers++;
+      if (live_triggered)
+        matched_triggers++;
+      frames_over = 0;
+      holdoff_until = t + holdoff_us;
+      armed = ro.hysteresis <= 0.0;
+      if (ro.list_triggers) {
+        ss << format_event_time(t) << "  trigger  score " <<
+          std::fixed << std::setprecision(3) << score <<
+          " > " << threshold << (live_triggered ? "" : "  (live did not)") <<
+          "\n";
+      }
+    }
+  }
+  std::cout << ss.str();
+
+  auto elapsed_s =
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - replay_started).count()/1000.0/1000.0;
+  double span_days = (last_time_us - first_time_us)/1000.0/1000.0/86400.0;
+
+  std::cout <<
+    "frames:            " << slr.total_frames << " in " <<
+      slr.blocks.size() << " blocks\n";
+  if (slr.total_frames > 0) {
+    std::cout <<
+    "span:              " << format_event_time(first_time_us) << " to " <<
+      format_event_time(last_time_us) << "\n";
+  }
+  std::cout <<
+    "final threshold:   " << std::fixed << std::setprecision(3) <<
+      threshold;
+  if (calibrate)
+    std::cout << " (" << adjustments << " online adjustments)";
+  std::cout << "\n" <<
+    "live triggers:     " << live_triggers << "\n" <<
+    "replay triggers:   " << replay_triggers <<
+      " (" << matched_triggers << " on the same frame as live)\n";
+  if (span_days > 0.0) {
+    std::cout <<
+    "triggers/day:      " << std::setprecision(1) <<
+      live_triggers/span_days << " live vs. " <<
+      replay_triggers/span_days << " replayed\n";
+  }
+  std::cout <<
+    "replay time:       " << std::setprecision(3) << elapsed_s*1000.0 <<
+      " ms (" << std::setprecision(1) <<
+      (elapsed_s > 0.0 ? slr.total_frames/elapsed_s/1.0e6 : 0.0) <<
+      " M frames/s)\n";
+  return EXIT_SUCCESS;
+}
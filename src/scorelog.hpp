@@ -0,0 +1,121 @@
+#ifndef SCORELOG_HPP
+#define SCORELOG_HPP
+
+#include "fs.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// The score log records every frame's motion score (adiff_ratio) so that
+// trigger policies can be replayed offline without the video.
+//
+// The file is a header followed by independent columnar blocks:
+//   score_log_block_header
+//   uint32_t dt_us[count]  // microseconds since the block's base_time_us
+//   float    score[count]
+//   uint8_t  flags[count]  // SCORE_FLAG_*
+//   (zero padding to a multiple of 8 bytes so the next block is aligned)
+// The writer buffers a block in memory, so the per-frame cost is three
+// vector appends.  It writes the block when full or SCORE_LOG_FLUSH_S after
+// it started, so a killed process loses at most that much.  A torn trailing
+// block is ignored by readers and cut off by the next writer.
+
+static const char     SCORE_LOG_MAGIC[8] = {'M','D','S','C','O','R','E','\0'};
+static const uint32_t SCORE_LOG_VERSION = 1;
+static const uint32_t SCORE_LOG_BLOCK_FRAMES = 4096; // about 2 minutes
+static const int SCORE_LOG_FLUSH_S = 10;
+
+// the detector had no calibrated threshold yet
+static const uint8_t SCORE_FLAG_CALIBRATING      = 0x1;
+// the live detector triggered on this frame
+static const uint8_t SCORE_FLAG_TRIGGERED        = 0x2;
+// first frame scored against a freshly reset background
+static const uint8_t SCORE_FLAG_BACKGROUND_RESET = 0x4;
+// over the threshold but rejected as a lighting change
+static const uint8_t SCORE_FLAG_LIGHTING         = 0x8;
+// the scan stopped early (under the live threshold); the score is only a
+// lower bound
+static const uint8_t SCORE_FLAG_BOUNDED          = 0x10;
+
+struct score_log_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+static_assert(sizeof(score_log_header) == 16, "unexpected header size");
+
+struct score_log_block_header {
+  int64_t  base_time_us; // microseconds since the Unix epoch
+  uint32_t count;
+  uint32_t reserved;
+};
+static_assert(sizeof(score_log_block_header) == 16, "unexpected header size");
+
+static inline size_t score_log_block_body_size(uint32_t count) {
+  size_t unpadded = (size_t)count*(sizeof(uint32_t) + sizeof(float) + 1);
+  return (unpadded + 7) & ~(size_t)7;
+}
+
+struct score_log_writer {
+  std::ofstream         stream;
+  int64_t               base_time_us = 0;
+  std::vector<uint32_t> dt_us;
+  std::vector<float>    scores;
+  std::vector<uint8_t>  flags;
+
+  ~score_log_writer() {flush();}
+
+  void open(const std::string &path, std::string &error);
+  bool is_open() const {return stream.is_open();}
+  void add(int64_t time_us, double score, uint8_t flags);
+  // writes the buffered (partial) block
+  void flush();
+};
+
+// a view of one block within a mapped score log
+struct score_log_block {
+  int64_t         base_time_us;
+  uint32_t        count;
+  const uint32_t *dt_us;
+  const float    *scores;
+  const uint8_t  *flags;
+};
+
+struct score_log_reader {
+  fs::mapped_file              file;
+  std::vector<score_log_block> blocks;
+  uint64_t                     total_frames = 0;
+
+  bool open(const std::string &path, std::string &error);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Offline replay of the trigger decision over a score log.
+//
+// NOTE: the live detector pauses detection while it records and resets
+// the background afterwards; the log has a gap there.  A replayed policy
+// that would have fired at a different time cannot see the scores the live
+// run never computed, so treat results as an estimate of trigger rates.
+// Likewise a SCORE_FLAG_BOUNDED score only shows the frame stayed under the
+// live threshold; it counts as quiet but doesn't calibrate.
+struct replay_options {
+  std::string path;
+  // <= 0.0 means calibrate online (as the live detector does)
+  double threshold = 0.0;
+  double calibration_mad_units = 6.0;
+  // once triggered we re-arm when the score drops below hysteresis*threshold
+  // (0.0 re-arms immediately as the live detector does)
+  double hysteresis = 0.0;
+  // seconds after a trigger that we ignore (the live capture length)
+  double holdoff_s = 30.0;
+  // consecutive frames over the threshold required to trigger
+  int    min_frames = 1;
+  bool   list_triggers = false;
+};
+
+// runs a replay emitting results to stdout; returns the process exit code
+int run_score_replay(const replay_options &ro);
+
+#endif
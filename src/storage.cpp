@@ -0,0 +1,302 @@
+#include "mdet.hpp"
+#include "fs.hpp"
+
+#include <algorithm>
+#include <set>
+
+static const char *const CLIP_PREFIX = "motion";
+
+std::string storage_clip_stem(const std::string &path)
+{
+  auto slash = path.find_last_of("/\\");
+  size_t name = slash == std::string::npos ? 0 : slash + 1;
+  if (path.compare(name, 6, CLIP_PREFIX) != 0)
+    return "";
+  size_t end = name + 6;
+  while (end < path.size() && std::isdigit((unsigned char)path[end]))
+    end++;
+  if (end == name + 6)
+    return "";
+  return path.substr(0, end);
+}
+
+// motion00042 -> 42
+static int clip_index(const std::string &stem)
+{
+  auto slash = stem.find_last_of("/\\");
+  return std::atoi(stem.c_str() +
+    (slash == std::string::npos ? 0 : slash + 1) + 6);
+}
+
+bool parse_byte_size(const std::string &s, int64_t &bytes)
+{
+  size_t end = 0;
+  double value = 0.0;
+  try {
+    value = std::stod(s, &end);
+  } catch (...) {
+    return false;
+  }
+  double scale = 1.0;
+  if (end < s.size()) {
+    switch (std::toupper((unsigned char)s[end])) {
+    case 'K': scale = 1024.0; break;
+    case 'M': scale = 1024.0*1024.0; break;
+    case 'G': scale = 1024.0*1024.0*1024.0; break;
+    case 'T': scale = 1024.0*1024.0*1024.0*1024.0; break;
+    default: return false;
+    }
+    end++;
+  }
+  if (end != s.size() || value < 0.0)
+    return false;
+  bytes = (int64_t)(value*scale);
+  return true;
+}
+
+std::string format_byte_size(int64_t bytes)
+{
+  static const char *const UNITS[] {"B", "K", "M", "G", "T"};
+  double v = (double)bytes;
+  int u = 0;
+  while (v >= 1024.0 && u < 4) {
+    v /= 1024.0;
+    u++;
+  }
+  return format(v,0,u == 0 ? 0 : 1) + UNITS[u];
+}
+
+static void run_storage_manager(storage_manager *sm) {
+  sm->run();
+}
+
+storage_manager::storage_manager(const opts &_os)
+  : os(_os)
+{
+  // scanned before the capture starts so the next clip index is known
+  if (has_budget()) {
+    scan();
+  } else {
+    // only the index; nothing is pruned
+    const std::string dir =
+      os.motion_video_dir.empty() ? "." : os.motion_video_dir;
+    for (const std::string &f : fs::list_directory(dir)) {
+      const std::string stem = storage_clip_stem(f);
+      if (!stem.empty())
+        next_index = std::max(next_index, clip_index(stem) + 1);
+    }
+  }
+  thread = std::thread(run_storage_manager, this);
+}
+
+storage_manager::~storage_manager() {
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    exit_storage = true;
+  }
+  work_ready.notify_one();
+  thread.join();
+}
+
+void storage_manager::add_clip(
+  const std::string &stem, std::vector<std::string> files)
+{
+  storage_clip c;
+  c.stem = stem;
+  c.files = std::move(files);
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    added.push_back(std::move(c));
+  }
+  work_ready.notify_one();
+}
+
+void storage_manager::pin(const std::string &stem) {
+  std::lock_guard<std::mutex> lk(mutex);
+  pinned[stem]++;
+}
+
+void storage_manager::unpin(const std::string &stem) {
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    auto it = pinned.find(stem);
+    if (it != pinned.end() && --it->second <= 0)
+      pinned.erase(it);
+  }
+  work_ready.notify_one(); // it may be prunable now
+}
+
+void storage_manager::remove_async(const std::string &p) {
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    deletes.push_back(p);
+  }
+  work_ready.notify_one();
+}
+
+std::vector<std::string> storage_manager::take_messages() {
+  std::lock_guard<std::mutex> lk(mutex);
+  std::vector<std::string> ms;
+  ms.swap(messages);
+  return ms;
+}
+
+void storage_manager::stat_clip(storage_clip &c) {
+  c.bytes = 0;
+  int64_t newest_age = -1;
+  for (const auto &f : c.files) {
+    c.bytes += std::max<int64_t>(0, fs::file_size(f));
+    int64_t age = fs::file_age_seconds(f);
+    if (age >= 0 && (newest_age < 0 || age < newest_age))
+      newest_age = age;
+  }
+  c.time_s = event_time_now()/1000/1000 - std::max<int64_t>(0, newest_age);
+}
+
+void storage_manager::scan() {
+  std::vector<std::string> dirs {os.motion_video_dir.empty() ?
+    std::string(".") : os.motion_video_dir};
+  for (const auto &d : os.storage_dirs)
+    if (d != dirs[0])
+      dirs.push_back(d);
+
+  std::map<std::string,storage_clip> found;
+  for (const auto &dir : dirs) {
+    for (std::string f : fs::list_directory(dir)) {
+      if (os.motion_video_dir.empty() && f.compare(0, 2, "./") == 0)
+        f = f.substr(2); // as video_file_stem names them
+      std::string stem = storage_clip_stem(f);
+      if (stem.empty())
+        continue;
+      storage_clip &c = found[stem];
+      c.stem = stem;
+      c.files.push_back(f);
+      if (dir == dirs[0])
+        next_index = std::max(next_index, clip_index(stem) + 1);
+    }
+  }
+  std::vector<storage_clip> sorted;
+  for (auto &sc : found) {
+    stat_clip(sc.second);
+    sorted.push_back(std::move(sc.second));
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+    [] (const storage_clip &a, const storage_clip &b) {
+      return a.time_s < b.time_s;
+    });
+  std::lock_guard<std::mutex> lk(mutex);
+  clips.assign(sorted.begin(), sorted.end());
+  total_bytes = 0;
+  for (const auto &c : clips)
+    total_bytes += c.bytes;
+  messages.push_back(concat("storage: ",clips.size()," clips (",
+    format_byte_size(total_bytes),") in ",dirs.size()," directories"));
+}
+
+void storage_manager::run() {
+  enter_thread_role(THREAD_STORAGE);
+  std::unique_lock<std::mutex> lk(mutex);
+  while (!exit_storage) {
+    work_ready.wait_for(lk, std::chrono::seconds(STORAGE_CHECK_S), [&] {
+      return exit_storage || !added.empty() || !deletes.empty();
+    });
+    std::vector<std::string> ds;
+    ds.swap(deletes);
+    std::vector<storage_clip> as;
+    as.swap(added);
+    lk.unlock();
+
+    for (const auto &d : ds)
+      fs::remove_if_exists(d);
+    for (auto &c : as)
+      stat_clip(c);
+
+    lk.lock();
+    for (auto &c : as) {
+      // an index reused from an earlier run replaces that clip
+      for (auto it = clips.begin(); it != clips.end(); ++it) {
+        if (it->stem == c.stem) {
+          total_bytes -= it->bytes;
+          clips.erase(it);
+          break;
+        }
+      }
+      total_bytes += c.bytes;
+      clips.push_back(std::move(c));
+    }
+    lk.unlock();
+    if (has_budget())
+      prune();
+    lk.lock();
+  }
+}
+
+void storage_manager::prune() {
+  const int64_t target_bytes =
+    (int64_t)(STORAGE_PRUNE_TARGET*os.storage_max_bytes);
+  bool pruning_bytes = false; // once over budget, go down to the target
+  // the capture thread takes the mutex at trigger time; so the file system
+  // is only touched with it released
+  std::set<std::string> kept; // clips with a .keep file (this pass)
+  while (true) {
+    std::vector<std::string> candidates; // unpinned stems, oldest first
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      for (const auto &c : clips)
+        if (!pinned.count(c.stem) && !kept.count(c.stem))
+          candidates.push_back(c.stem);
+    }
+    std::string stem;
+    for (const auto &cs : candidates) {
+      if (!fs::file_exists(cs + ".keep")) {
+        stem = cs;
+        break;
+      }
+      kept.insert(cs);
+    }
+    if (stem.empty())
+      return;
+    int64_t available = -1;
+    if (os.storage_min_free_bytes > 0) {
+      auto slash = stem.find_last_of("/\\");
+      available = fs::available_space(
+        slash == std::string::npos ? std::string(".") : stem.substr(0, slash));
+    }
+
+    storage_clip victim;
+    const char *why = nullptr;
+    {
+      std::lock_guard<std::mutex> lk(mutex);
+      auto it = std::find_if(clips.begin(), clips.end(),
+        [&] (const storage_clip &c) {return c.stem == stem;});
+      // pinned (or replaced) while we looked; look again
+      if (it == clips.end() || pinned.count(stem))
+        continue;
+      const int64_t now_s = event_time_now()/1000/1000;
+      if (os.storage_max_bytes > 0 && (total_bytes > os.storage_max_bytes ||
+        (pruning_bytes && total_bytes > target_bytes)))
+      {
+        pruning_bytes = true;
+        why = "over the byte budget";
+      } else if (os.storage_max_age_s > 0.0 &&
+        now_s - it->time_s > os.storage_max_age_s)
+      {
+        why = "too old";
+      } else if (available >= 0 && available < os.storage_min_free_bytes) {
+        why = "the disk is nearly full";
+      }
+      if (!why)
+        return;
+      victim = *it;
+      total_bytes -= it->bytes;
+      clips.erase(it);
+      pruned_clips++;
+      pruned_bytes += victim.bytes;
+    }
+    for (const auto &f : victim.files)
+      fs::remove_if_exists(f);
+    std::lock_guard<std::mutex> lk(mutex);
+    messages.push_back(concat("storage: pruned ",victim.stem," (",
+      format_byte_size(victim.bytes),"; ",why,")"));
+  }
+}
@@ -0,0 +1,338 @@
+#include "sweep.hpp"
+#include "calibrator.hpp"
+#include "mdet.hpp"
+
+#include <atomic>
+#include <map>
+#include <utility>
+
+// frames decoded (and shared) before the workers run over them
+static const int SWEEP_BATCH_FRAMES = 64;
+
+struct sweep_config {
+  int     scale_index;
+  int     blur;
+  double  learning_rate;
+  double  threshold; // calibrated online if it starts as 0.0
+  bool    calibrate;
+
+  image    background; // CV_32F when learning_rate > 0
+  bool     has_background = false;
+  int64_t  holdoff_until = -1; // frame index
+  online_calibrator calibrator;
+
+  uint64_t triggers = 0;
+  uint64_t scored_frames = 0;
+  double   score_sum = 0.0, score_max = 0.0;
+};
+
+// a whole detector (detector.cpp) at one threshold
+struct sweep_detector {
+  std::unique_ptr<detector> det;
+  double   threshold;
+  bool     calibrate;
+
+  bool     has_background = false;
+  int64_t  holdoff_until = -1;
+  online_calibrator calibrator;
+
+  uint64_t triggers = 0;
+  uint64_t scored_frames = 0;
+  double   score_sum = 0.0, score_max = 0.0;
+  int64_t  cost_us = 0;
+
+  void run(
+    const std::vector<image> &color_frames,
+    int64_t batch_start,
+    int batch_frames,
+    int64_t holdoff_frames);
+};
+
+void sweep_detector::run(
+  const std::vector<image> &color_frames,
+  int64_t batch_start,
+  int batch_frames,
+  int64_t holdoff_frames)
+{
+  for (int f = 0; f < batch_frames; f++) {
+    const int64_t frame_index = batch_start + f;
+    if (frame_index < holdoff_until)
+      continue;
+    if (!has_background) {
+      det->reset(color_frames[f]);
+      has_background = true;
+      continue;
+    }
+    auto started = now();
+    double score = det->score(color_frames[f], calibrate &&
+      !calibrator.calibrated() ? 0.0 : threshold);
+    bool triggered = threshold > 0.0 && score > threshold;
+    det->learn(triggered);
+    cost_us += std::chrono::duration_cast<std::chrono::microseconds>(
+      now() - started).count();
+    scored_frames++;
+    score_sum += score;
+    score_max = std::max(score_max, score);
+    if (triggered) {
+      triggers++;
+      holdoff_until = frame_index + 1 + holdoff_frames;
+      has_background = false;
+    } else if (calibrate && calibrator.add(score)) {
+      threshold = calibrator.threshold;
+    }
+  }
+}
+
+struct sweep_group {
+  int scale_index;
+  int blur;
+  std::vector<sweep_config*> configs;
+
+  // scratch images (one group is only ever run by one thread at a time)
+  image blurred, blurred_f, diff;
+
+  void run(
+    const std::vector<std::vector<image>> &scaled_frames,
+    int64_t batch_start,
+    int batch_frames,
+    int64_t holdoff_frames);
+};
+
+void sweep_group::run(
+  const std::vector<std::vector<image>> &scaled_frames,
+  int64_t batch_start,
+  int batch_frames,
+  int64_t holdoff_frames)
+{
+  for (int f = 0; f < batch_frames; f++) {
+    const int64_t frame_index = batch_start + f;
+    cv::GaussianBlur(
+      scaled_frames[scale_index][f], blurred, cv::Size(blur,blur), 0.0);
+    bool converted = false;
+
+    for (sweep_config *sc : configs) {
+      if (frame_index < sc->holdoff_until)
+        continue; // "recording"
+      const bool running_average = sc->learning_rate > 0.0;
+      if (running_average && !converted) {
+        blurred.convertTo(blurred_f, CV_32F);
+        converted = true;
+      }
+      if (!sc->has_background) {
+        // the live detector resets the background after a capture
+        if (running_average)
+          blurred_f.copyTo(sc->background);
+        else
+          blurred.copyTo(sc->background);
+        sc->has_background = true;
+        continue;
+      }
+
+      cv::absdiff(
+        running_average ? blurred_f : blurred, sc->background, diff);
+      double score = cv::sum(diff)[0]/diff.size().area();
+      sc->scored_frames++;
+      sc->score_sum += score;
+      sc->score_max = std::max(sc->score_max, score);
+
+      if (sc->threshold > 0.0 && score > sc->threshold) {
+        sc->triggers++;
+        sc->holdoff_until = frame_index + 1 + holdoff_frames;
+        sc->has_background = false;
+        continue;
+      }
+      if (sc->calibrate && sc->calibrator.add(score))
+        sc->threshold = sc->calibrator.threshold;
+      if (running_average)
+        cv::accumulateWeighted(blurred_f, sc->background, sc->learning_rate);
+    }
+  }
+}
+
+int run_sweep(const sweep_options &so)
+{
+  auto sweep_started = now();
+
+  cv::VideoCapture vc(so.video_path);
+  if (!vc.isOpened()) {
+    std::cerr << so.video_path << ": failed to open video\n";
+    return EXIT_FAILURE;
+  }
+  double fps = vc.get(cv::CAP_PROP_FPS);
+  if (fps <= 0.0)
+    fps = TARGET_FPS;
+  const int64_t holdoff_frames = (int64_t)(so.holdoff_s*fps);
+
+  for (int blur : so.blur_sizes) {
+    if (blur <= 0 || blur % 2 == 0) {
+      std::cerr << "blur sizes must be positive odd integers\n";
+      return EXIT_FAILURE;
+    }
+  }
+  for (int scale : so.scales) {
+    if (scale <= 0) {
+      std::cerr << "scales must be positive integers\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // the cross product of configurations grouped by (scale, blur)
+  std::vector<sweep_config> configs;
+  for (int si = 0; si < (int)so.scales.size(); si++)
+    for (int blur : so.blur_sizes)
+      for (double lr : so.learning_rates)
+        for (double th : so.thresholds) {
+          sweep_config sc;
+          sc.scale_index = si;
+          sc.blur = blur;
+          sc.learning_rate = lr;
+          sc.threshold = th;
+          sc.calibrate = th <= 0.0;
+          sc.calibrator.mad_units = so.calibration_mad_units;
+          configs.push_back(sc);
+        }
+  std::vector<sweep_detector> detectors;
+  for (const std::string &name : so.detectors)
+    for (double th : so.thresholds) {
+      std::string error;
+      sweep_detector sd;
+      sd.det = create_detector(name, error);
+      if (!sd.det) {
+        std::cerr << error << "\n";
+        return EXIT_FAILURE;
+      }
+      sd.threshold = th;
+      sd.calibrate = th <= 0.0;
+      sd.calibrator.mad_units = so.calibration_mad_units;
+      detectors.push_back(std::move(sd));
+    }
+
+  std::vector<sweep_group> groups;
+  std::map<std::pair<int,int>,size_t> group_index;
+  for (sweep_config &sc : configs) {
+    auto key = std::make_pair(sc.scale_index, sc.blur);
+    auto itr = group_index.find(key);
+    if (itr == group_index.end()) {
+      itr = group_index.emplace(key, groups.size()).first;
+      groups.emplace_back();
+      groups.back().scale_index = sc.scale_index;
+      groups.back().blur = sc.blur;
+    }
+    groups[itr->second].configs.push_back(&sc);
+  }
+
+  int jobs = so.jobs > 0 ? so.jobs : (int)std::thread::hardware_concurrency();
+  const size_t work_items = groups.size() + detectors.size();
+  jobs = std::max(1, std::min(jobs, (int)work_items));
+  std::cout << so.video_path << ": " << configs.size() <<
+    " configurations in " << groups.size() << " groups";
+  if (!detectors.empty())
+    std::cout << " and " << detectors.size() << " detector configurations";
+  std::cout << " on " << jobs << " threads\n";
+
+  // scaled_frames[scale_index][frame in batch]
+  std::vector<std::vector<image>> scaled_frames(so.scales.size());
+  for (auto &sfs : scaled_frames)
+    sfs.resize(SWEEP_BATCH_FRAMES);
+  // detectors want the color frames
+  std::vector<image> color_frames(detectors.empty() ? 1 : SWEEP_BATCH_FRAMES);
+  image gray;
+
+  int64_t total_frames = 0;
+  bool eof = false;
+  while (!eof) {
+    int batch_frames = 0;
+    for (; batch_frames < SWEEP_BATCH_FRAMES; batch_frames++) {
+      image &color = color_frames[detectors.empty() ? 0 : batch_frames];
+      if (!vc.read(color) || color.empty()) {
+        eof = true;
+        break;
+      }
+      cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+      for (int si = 0; si < (int)so.scales.size(); si++) {
+        image &dst = scaled_frames[si][batch_frames];
+        if (so.scales[si] == 1) {
+          gray.copyTo(dst);
+        } else {
+          cv::resize(gray, dst,
+            cv::Size(gray.cols/so.scales[si], gray.rows/so.scales[si]),
+            0, 0, cv::INTER_AREA);
+        }
+      }
+    }
+    if (batch_frames == 0)
+      break;
+
+    std::atomic<size_t> next_group(0);
+    auto worker = [&] () {
+      size_t gi;
+      while ((gi = next_group++) < work_items) {
+        if (gi < groups.size()) {
+          groups[gi].run(
+            scaled_frames, total_frames, batch_frames, holdoff_frames);
+        } else {
+          detectors[gi - groups.size()].run(
+            color_frames, total_frames, batch_frames, holdoff_frames);
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < jobs; i++)
+      threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+      t.join();
+
+    total_frames += batch_frames;
+  }
+
+  auto elapsed_s =
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      now() - sweep_started).count()/1000.0/1000.0;
+  const double video_hours = total_frames/fps/3600.0;
+
+  std::stringstream ss;
+  ss <<
+    " blur scale  learn    thresh  triggers   trig/hr  avg score  max score\n";
+  for (const sweep_config &sc : configs) {
+    ss << std::setw(5) << sc.blur <<
+      std::setw(6) << so.scales[sc.scale_index] <<
+      std::setw(7) << std::fixed << std::setprecision(3) << sc.learning_rate <<
+      std::setw(10) << sc.threshold <<
+      (sc.calibrate ? "*" : " ") << // the final online calibration
+      std::setw(9) << sc.triggers <<
+      std::setw(10) << std::setprecision(1) <<
+        (video_hours > 0.0 ? sc.triggers/video_hours : 0.0) <<
+      std::setw(11) << std::setprecision(3) <<
+        (sc.scored_frames ? sc.score_sum/sc.scored_frames : 0.0) <<
+      std::setw(11) << sc.score_max <<
+      "\n";
+  }
+  if (!detectors.empty()) {
+    ss << "\n"
+      "       detector    thresh  triggers   trig/hr  avg score  max score"
+      "  ms/frame\n";
+    for (const sweep_detector &sd : detectors) {
+      ss << std::setw(15) << sd.det->name() <<
+        std::setw(10) << std::fixed << std::setprecision(3) << sd.threshold <<
+        (sd.calibrate ? "*" : " ") <<
+        std::setw(9) << sd.triggers <<
+        std::setw(10) << std::setprecision(1) <<
+          (video_hours > 0.0 ? sd.triggers/video_hours : 0.0) <<
+        std::setw(11) << std::setprecision(3) <<
+          (sd.scored_frames ? sd.score_sum/sd.scored_frames : 0.0) <<
+        std::setw(11) << sd.score_max <<
+        std::setw(10) <<
+          (sd.scored_frames ? sd.cost_us/1000.0/sd.scored_frames : 0.0) <<
+        "\n";
+    }
+  }
+  ss << "(* calibrated online; the threshold shown is the final one)\n";
+  ss << total_frames << " frames (" <<
+    format(total_frames/fps,0,1) << " s of video) in " <<
+    format(elapsed_s,0,1) << " s (" <<
+    format(elapsed_s > 0.0 ? total_frames/fps/elapsed_s : 0.0,0,1) <<
+    "x real time)\n";
+  std::cout << ss.str();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+#ifndef SWEEP_HPP
+#define SWEEP_HPP
+
+#include <string>
+#include <vector>
+
+// A parameter sweep decodes a recorded video once and evaluates every
+// (blur, scale, learning rate, threshold) configuration over it.
+//
+// Each frame is converted to gray once and downscaled once per scale; each
+// (scale, blur) pair is blurred once and shared by all the configurations
+// using it.  The (scale, blur) groups are spread over a pool of threads.
+//
+// Configurations mimic the live detector: a trigger starts a capture
+// (frames are ignored for the hold-off) and then the background is reset.
+// A learning rate > 0 instead blends each quiet frame into a running
+// average background.
+//
+// Detectors (see --detector) listed in detectors are also run over the same
+// frames with each threshold; they are reported in a second table with
+// their scoring cost per frame so the cheapest adequate one can be picked.
+struct sweep_options {
+  std::string         video_path;
+  std::vector<int>    blur_sizes {21};     // odd kernel sizes (scaled pixels)
+  std::vector<int>    scales {1};          // detection downscale factors
+  std::vector<double> learning_rates {0.0};
+  std::vector<double> thresholds {0.0};    // 0.0 means calibrate online
+  std::vector<std::string> detectors;      // whole detectors to compare
+  double              calibration_mad_units = 6.0;
+  double              holdoff_s = 30.0;
+  int                 jobs = 0;            // 0 means one per hardware thread
+};
+
+// runs a sweep emitting a table to stdout; returns the process exit code
+int run_sweep(const sweep_options &so);
+
+#endif
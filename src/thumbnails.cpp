@@ -0,0 +1,151 @@
+#include "mdet.hpp"
+#include "fs.hpp"
+
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+static void run_thumbnail_job(thumbnail_job *tj) {
+  tj->run();
+}
+
+thumbnail_job::thumbnail_job(
+  std::string _stem,
+  event_keyframes &&_keyframes,
+  std::string _remote_copy_dir,
+  std::vector<std::string> _clip_files)
+    : stem(_stem)
+    , keyframes(std::move(_keyframes))
+    , remote_copy_dir(_remote_copy_dir)
+    , clip_files(_clip_files)
+    , thread(run_thumbnail_job, this)
+{
+}
+
+void thumbnail_job::run() {
+  enter_thread_role(THREAD_THUMBNAIL);
+  const std::vector<int> params {cv::IMWRITE_JPEG_QUALITY, THUMBNAIL_QUALITY};
+  struct {const char *suffix; const image &frame; std::string label;}
+    thumbnails[] {
+      {"-trigger.jpg", keyframes.trigger, "trigger"},
+      {"-peak.jpg", keyframes.peak,
+        "peak " + format(keyframes.peak_score,0,3)},
+      {"-last.jpg", keyframes.last, "last"},
+    };
+  std::vector<image> sheet;
+  for (const auto &t : thumbnails) {
+    if (t.frame.empty())
+      continue;
+    image small;
+    cv::resize(t.frame, small,
+      cv::Size(THUMBNAIL_WIDTH,
+        std::max(1, t.frame.rows*THUMBNAIL_WIDTH/t.frame.cols)),
+      0.0, 0.0, cv::INTER_AREA);
+    const std::string file_name = stem + t.suffix;
+    if (!cv::imwrite(file_name, small, params)) {
+      error_message = file_name + ": failed to write thumbnail";
+      continue;
+    }
+    files.push_back(file_name);
+    // the sheet's copy gets a caption
+    image captioned = small.clone();
+    cv::putText(captioned, t.label, cv::Point(4, 16),
+      cv::FONT_HERSHEY_PLAIN, 1.0, cv::Scalar(0,0,0), 3);
+    cv::putText(captioned, t.label, cv::Point(4, 16),
+      cv::FONT_HERSHEY_PLAIN, 1.0, cv::Scalar(255,255,255), 1);
+    sheet.push_back(captioned);
+  }
+  if (!sheet.empty()) {
+    image contact_sheet;
+    cv::hconcat(sheet, contact_sheet);
+    const std::string file_name = stem + "-sheet.jpg";
+    if (cv::imwrite(file_name, contact_sheet, params))
+      files.push_back(file_name);
+    else
+      error_message = file_name + ": failed to write contact sheet";
+  }
+  // a few kilobytes; so these go ahead of the clip's videos
+  if (!remote_copy_dir.empty()) {
+    for (const auto &f : files) {
+      const std::string target = fs::join_path(remote_copy_dir, f);
+      std::string error;
+      fs::copy_overwrite_with_error_message(f, target, error);
+      if (!error.empty())
+        error_message = target + ": " + error;
+    }
+  }
+  done = true;
+}
+
+void motion_detector::start_keyframes()
+{
+  keyframes.reset(new event_keyframes());
+  color_frames.newest().copyTo(keyframes->trigger);
+  keyframes->peak = keyframes->trigger;
+  keyframes->peak_score = last_motion_score;
+}
+
+void motion_detector::track_keyframes(double score)
+{
+  if (!keyframes)
+    return;
+  event_keyframes &ek = *keyframes;
+  if (score > ek.peak_score) {
+    // a rising score would copy every frame; so only remember where it is
+    ek.peak_score = score;
+    ek.peak_seq = color_frames.total;
+  } else if (ek.peak_seq != 0 &&
+    color_frames.total - ek.peak_seq >= PREVIOUS_FRAMES - 1)
+  {
+    // the next capture overwrites it
+    image peak;
+    color_frames.elements[(ek.peak_seq - 1) % PREVIOUS_FRAMES].copyTo(peak);
+    ek.peak = peak; // (not into trigger, which peak may still share)
+    ek.peak_seq = 0;
+  }
+}
+
+event_keyframes motion_detector::finish_keyframes()
+{
+  event_keyframes ek = std::move(*keyframes);
+  keyframes.reset();
+  if (ek.peak_seq != 0) {
+    image peak;
+    color_frames.elements[(ek.peak_seq - 1) % PREVIOUS_FRAMES].copyTo(peak);
+    ek.peak = peak; // (not into trigger, which peak may still share)
+    ek.peak_seq = 0;
+  }
+  color_frames.newest().copyTo(ek.last);
+  return ek;
+}
+
+void motion_detector::start_thumbnail_job(
+  const std::string &stem, std::vector<std::string> clip_files)
+{
+  log(stem,": starting thumbnail job");
+  storage->pin(stem);
+  thumbnail_jobs.push_back(new thumbnail_job(stem, finish_keyframes(),
+    os.remote_copy_dir, clip_files));
+  clip_thumbnail_job = thumbnail_jobs.back();
+}
+
+void motion_detector::finish_thumbnail_job(thumbnail_job *tj)
+{
+  tj->thread.join();
+  if (!tj->error_message.empty())
+    log(tj->stem,": ERROR: ",tj->error_message);
+  log(tj->stem,": wrote ",tj->files.size()," thumbnails");
+  if (tj == clip_thumbnail_job)
+    clip_thumbnail_job = nullptr;
+  if (tj->event_offset >= 0) {
+    // (three frames and the sheet)
+    if (tj->files.size() == 4)
+      tj->event.flags |= EVENT_FLAG_THUMBNAILS;
+    event_index.update(tj->event_offset, tj->event);
+  }
+  std::vector<std::string> files = tj->clip_files;
+  files.insert(files.end(), tj->files.begin(), tj->files.end());
+  storage->add_clip(tj->stem, files);
+  for (const auto &f : tj->clip_files)
+    start_copy_to_remote_async(f);
+  storage->unpin(tj->stem);
+  delete tj;
+}
@@ -0,0 +1,230 @@
+#include "mdet.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static std::mutex topology_mutex;
+static thread_topology topology;                   // guarded by topology_mutex
+static std::array<std::string,THREAD_ROLES> status; // guarded by topology_mutex
+
+thread_topology default_thread_settings() {
+  thread_topology tt;
+  // no affinity: threads inherit the creator's mask on Linux, and OpenCV's
+  // parallel_for_ pool and FFmpeg's encoder threads are created from the
+  // capture thread after it pins itself; a one core mask would serialize
+  // them (--thread-cpus pins roles on purpose)
+  // a frame waits on capture; nothing waits on a copy
+  tt[THREAD_CAPTURE].has_nice = true;
+  tt[THREAD_CAPTURE].nice = -5;
+  tt[THREAD_HUD].has_nice = true;
+  tt[THREAD_HUD].nice = 5;
+  tt[THREAD_COPY].has_nice = true;
+  tt[THREAD_COPY].nice = 10;
+  tt[THREAD_COPY].policy = "batch";
+  tt[THREAD_WRITER].has_nice = true;
+  tt[THREAD_WRITER].nice = 5;
+  tt[THREAD_CONFIG].has_nice = true;
+  tt[THREAD_CONFIG].nice = 10;
+  tt[THREAD_STORAGE].has_nice = true;
+  tt[THREAD_STORAGE].nice = 10;
+  tt[THREAD_STORAGE].policy = "batch";
+  tt[THREAD_THUMBNAIL].has_nice = true;
+  tt[THREAD_THUMBNAIL].nice = 10;
+  tt[THREAD_THUMBNAIL].policy = "batch";
+  return tt;
+}
+
+static bool parse_cpu_list(const std::string &s, std::vector<int> &cpus) {
+  // e.g. 0,2-3
+  cpus.clear();
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    auto dash = item.find('-');
+    int lo = std::stoi(item.substr(0, dash));
+    int hi = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+    if (lo < 0 || hi < lo)
+      return false;
+    for (int c = lo; c <= hi; c++)
+      cpus.push_back(c);
+  }
+  return !cpus.empty();
+}
+
+bool parse_thread_setting(
+  const std::string &what, const std::string &value,
+  thread_topology &tt, std::string &error)
+{
+  auto colon = value.find(':');
+  if (colon == std::string::npos) {
+    error = "expected ROLE:VALUE";
+    return false;
+  }
+  const std::string role = value.substr(0, colon);
+  const std::string setting = value.substr(colon + 1);
+  int r = 0;
+  while (r < THREAD_ROLES && role != THREAD_ROLE_NAMES[r])
+    r++;
+  if (r == THREAD_ROLES) {
+    error = role + ": unknown thread role";
+    return false;
+  }
+  thread_settings &ts = tt[r];
+  try {
+    if (what == "cpus") {
+      if (!parse_cpu_list(setting, ts.cpus)) {
+        error = "malformed cpu list";
+        return false;
+      }
+    } else if (what == "nice") {
+      ts.nice = std::stoi(setting);
+      ts.has_nice = true;
+      if (ts.nice < -20 || ts.nice > 19) {
+        error = "nice must be in [-20,19]";
+        return false;
+      }
+    } else { // policy
+      auto pcolon = setting.find(':');
+      ts.policy = setting.substr(0, pcolon);
+      ts.priority =
+        pcolon == std::string::npos ? 1 : std::stoi(setting.substr(pcolon + 1));
+      if (ts.policy != "other" && ts.policy != "batch" &&
+        ts.policy != "idle" && ts.policy != "fifo" && ts.policy != "rr")
+      {
+        error = ts.policy + ": unknown policy";
+        return false;
+      }
+    }
+  } catch (...) {
+    error = "malformed integer";
+    return false;
+  }
+  return true;
+}
+
+void set_thread_topology(const thread_topology &tt) {
+  std::lock_guard<std::mutex> lk(topology_mutex);
+  topology = tt;
+}
+
+#ifdef _WIN32
+static std::string apply_settings(thread_role, const thread_settings &ts) {
+  // thread names need SetThreadDescription (Windows 10 1607); skipped
+  std::stringstream ss;
+  HANDLE t = GetCurrentThread();
+  if (!ts.cpus.empty()) {
+    DWORD_PTR mask = 0;
+    for (int c : ts.cpus)
+      if (c < (int)(8*sizeof(mask)))
+        mask |= (DWORD_PTR)1 << c;
+    ss << "cpus";
+    for (int c : ts.cpus)
+      ss << " " << c;
+    if (!SetThreadAffinityMask(t, mask))
+      ss << " (failed)";
+  }
+  // Windows has priority levels rather than nice values or policies
+  int priority = THREAD_PRIORITY_NORMAL;
+  if (ts.policy == "fifo" || ts.policy == "rr")
+    priority = THREAD_PRIORITY_HIGHEST;
+  else if (ts.policy == "idle")
+    priority = THREAD_PRIORITY_IDLE;
+  else if (ts.has_nice && ts.nice < 0)
+    priority = THREAD_PRIORITY_ABOVE_NORMAL;
+  else if ((ts.has_nice && ts.nice > 0) || ts.policy == "batch")
+    priority = THREAD_PRIORITY_BELOW_NORMAL;
+  if (priority != THREAD_PRIORITY_NORMAL) {
+    ss << (ss.tellp() > 0 ? ", " : "") << "priority " << priority;
+    if (!SetThreadPriority(t, priority))
+      ss << " (failed)";
+  }
+  return ss.str();
+}
+#else
+static std::string apply_settings(thread_role r, const thread_settings &ts) {
+  std::stringstream ss;
+  pthread_t self = pthread_self();
+#ifdef __linux__
+  // at most 15 characters
+  std::string name = std::string("mdet-") + THREAD_ROLE_NAMES[r];
+  pthread_setname_np(self, name.c_str());
+
+  if (!ts.cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : ts.cpus)
+      if (c < CPU_SETSIZE)
+        CPU_SET(c, &set);
+    ss << "cpus";
+    for (int c : ts.cpus)
+      ss << " " << c;
+    if (pthread_setaffinity_np(self, sizeof(set), &set) != 0)
+      ss << " (failed)";
+  }
+#else
+  (void)r;
+#endif
+  if (!ts.policy.empty()) {
+    int policy = SCHED_OTHER;
+#ifdef __linux__
+    if (ts.policy == "batch")
+      policy = SCHED_BATCH;
+    else if (ts.policy == "idle")
+      policy = SCHED_IDLE;
+#endif
+    if (ts.policy == "fifo")
+      policy = SCHED_FIFO;
+    else if (ts.policy == "rr")
+      policy = SCHED_RR;
+    sched_param sp { };
+    if (policy == SCHED_FIFO || policy == SCHED_RR)
+      sp.sched_priority = ts.priority;
+    ss << (ss.tellp() > 0 ? ", " : "") << ts.policy;
+    if (policy == SCHED_FIFO || policy == SCHED_RR)
+      ss << " " << ts.priority;
+    int err = pthread_setschedparam(self, policy, &sp);
+    if (err == EPERM)
+      ss << " (not permitted)";
+    else if (err != 0)
+      ss << " (failed)";
+  }
+  if (ts.has_nice) {
+    ss << (ss.tellp() > 0 ? ", " : "") << "nice " << ts.nice;
+#ifdef __linux__
+    // Linux nice values are per thread
+    id_t who = (id_t)syscall(SYS_gettid);
+#else
+    id_t who = 0; // the whole process elsewhere
+#endif
+    if (setpriority(PRIO_PROCESS, who, ts.nice) != 0)
+      ss << (errno == EACCES || errno == EPERM ?
+        " (not permitted)" : " (failed)");
+  }
+  return ss.str();
+}
+#endif
+
+void enter_thread_role(thread_role r) {
+  thread_settings ts;
+  {
+    std::lock_guard<std::mutex> lk(topology_mutex);
+    ts = topology[r];
+  }
+  std::string s = apply_settings(r, ts);
+  std::lock_guard<std::mutex> lk(topology_mutex);
+  status[r] = s.empty() ? "(unchanged)" : s;
+}
+
+std::string thread_role_status(thread_role r) {
+  std::lock_guard<std::mutex> lk(topology_mutex);
+  return status[r].empty() ? "(not started)" : status[r];
+}
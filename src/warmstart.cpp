@@ -0,0 +1,161 @@
+#include "mdet.hpp"
+#include "fs.hpp"
+
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+#include <cstring>
+
+// A warm start snapshot (--warm-start) lets a restart skip the threshold
+// calibration.  The background frame is only there to check that the scene
+// still matches; detection restarts from the live scene, and a detector's
+// own model (the running average, MOG2 or KNN) is not kept, so those still
+// learn from scratch.
+//
+//   warm_start_header
+//   float   calibration_samples[header.calibration_samples] // oldest first
+//   uint8_t background[header.background_bytes] // JPEG of the color frame
+//
+// The learned activity map is kept in its own file (--activity-map).
+static const char WARM_START_MAGIC[8] = {'M','D','W','A','R','M','\0','\0'};
+static const uint32_t WARM_START_VERSION = 2; // 2 added the camera
+// frames we give the camera to show a scene matching the snapshot
+static const int WARM_START_FRAMES = 2;
+
+struct warm_start_header {
+  char     magic[8];
+  uint32_t version;
+  uint16_t width, height;
+  int64_t  saved_time_us;
+  char     detector[16];
+  double   motion_threshold;
+  double   min_motion_diff, max_motion_diff;
+  uint32_t calibration_samples;
+  uint32_t background_bytes;
+  uint16_t camera; // opts::camera (a snapshot is only good for its own view)
+  uint8_t  reserved[6];
+};
+static_assert(sizeof(warm_start_header) == 80, "unexpected header size");
+
+void motion_detector::save_warm_start() {
+  // nothing worth keeping yet
+  if (os.warm_start_path.empty() || background_frame_color.empty() ||
+    (!os.has_custom_motion_threshold && !calibrator.calibrated()))
+  {
+    return;
+  }
+
+  std::vector<uint8_t> background;
+  if (!cv::imencode(".jpg", background_frame_color, background,
+    std::vector<int>{cv::IMWRITE_JPEG_QUALITY, 90}))
+  {
+    log(os.warm_start_path,": WARNING: failed to encode background");
+    return;
+  }
+  const std::vector<float> samples = calibrator.window();
+
+  warm_start_header wsh { };
+  std::memcpy(wsh.magic, WARM_START_MAGIC, sizeof(wsh.magic));
+  wsh.version = WARM_START_VERSION;
+  wsh.width = (uint16_t)background_frame_color.cols;
+  wsh.height = (uint16_t)background_frame_color.rows;
+  wsh.saved_time_us = event_time_now();
+  std::strncpy(wsh.detector, motion_algorithm->name(),
+    sizeof(wsh.detector) - 1);
+  wsh.motion_threshold = motion_threshold;
+  wsh.min_motion_diff = min_motion_diff;
+  wsh.max_motion_diff = max_motion_diff;
+  wsh.calibration_samples = (uint32_t)samples.size();
+  wsh.background_bytes = (uint32_t)background.size();
+  wsh.camera = (uint16_t)os.camera;
+
+  // write beside it and swap it in so a crash can't leave half a snapshot
+  const std::string tmp_path = os.warm_start_path + ".tmp";
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+    ofs.write((const char *)&wsh, sizeof(wsh));
+    ofs.write((const char *)samples.data(), samples.size()*sizeof(float));
+    ofs.write((const char *)background.data(), background.size());
+    if (!ofs) {
+      log(os.warm_start_path,": WARNING: failed to write snapshot");
+      return;
+    }
+  }
+  std::string error;
+  fs::rename_overwrite(tmp_path, os.warm_start_path, error);
+  if (!error.empty())
+    log(os.warm_start_path,": WARNING: ",error);
+}
+
+bool motion_detector::load_warm_start() {
+  if (os.warm_start_path.empty())
+    return false;
+  auto fail = [&] (const char *why) {
+    log(os.warm_start_path,": ",why," (cold start)");
+    return false;
+  };
+
+  std::ifstream ifs(os.warm_start_path, std::ios::binary);
+  if (!ifs)
+    return fail("no snapshot");
+  warm_start_header wsh;
+  // (the sizes are checked against the file before anything is allocated)
+  if (!ifs.read((char *)&wsh, sizeof(wsh)) ||
+    std::memcmp(wsh.magic, WARM_START_MAGIC, sizeof(wsh.magic)) != 0 ||
+    wsh.version != WARM_START_VERSION ||
+    wsh.calibration_samples > CALIBRATION_WINDOW ||
+    (int64_t)(sizeof(wsh) + wsh.calibration_samples*sizeof(float)) +
+      wsh.background_bytes != fs::file_size(os.warm_start_path))
+  {
+    return fail("malformed snapshot");
+  }
+  if (wsh.camera != (uint16_t)os.camera)
+    return fail("snapshot is from another camera");
+  wsh.detector[sizeof(wsh.detector) - 1] = 0;
+  if (os.detector != wsh.detector)
+    return fail("snapshot is from another detector");
+  std::vector<float> samples(wsh.calibration_samples);
+  std::vector<uint8_t> background(wsh.background_bytes);
+  if (!ifs.read((char *)samples.data(), samples.size()*sizeof(float)) ||
+    !ifs.read((char *)background.data(), background.size()))
+  {
+    return fail("truncated snapshot");
+  }
+  image snapshot_background = cv::imdecode(background, cv::IMREAD_COLOR);
+  if (snapshot_background.empty())
+    return fail("failed to decode the snapshot background");
+
+  online_calibrator restored;
+  restored.mad_units = os.calibration_mad_units;
+  for (float s : samples)
+    restored.add(s);
+  const double threshold = os.has_custom_motion_threshold ?
+    os.motion_threshold : restored.threshold;
+  if (threshold <= 0.0)
+    return fail("snapshot has no calibration");
+
+  // the scene must still look like the snapshot's background (same
+  // camera, lighting and framing) for its threshold to mean anything
+  for (int i = 0; i < WARM_START_FRAMES; i++) {
+    const image &frame = capture_frame();
+    if (frame.cols != wsh.width || frame.rows != wsh.height)
+      return fail("snapshot is for another frame size");
+    motion_algorithm->reset(snapshot_background);
+    double score = motion_algorithm->score(frame, 0.0);
+    if (score <= threshold) {
+      log(os.warm_start_path,": warm start from snapshot of ",
+        format_event_time(wsh.saved_time_us)," (scene scores ",
+        format(score,0,3)," against threshold ",format(threshold,0,3),")");
+      calibrator = restored;
+      motion_threshold = threshold;
+      min_motion_diff = wsh.min_motion_diff;
+      max_motion_diff = wsh.max_motion_diff;
+      // detect against the live scene rather than the old background
+      reset_background(0,"warm start");
+      return true;
+    }
+    log(os.warm_start_path,": scene scores ",format(score,0,3),
+      " against the snapshot (threshold ",format(threshold,0,3),")");
+    process_key(wait_next_frame());
+  }
+  return fail("the scene no longer matches the snapshot");
+}